@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
@@ -6,15 +7,26 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <limits.h>
+
+#define MAX_JOBS    (256)
 
 int create_link( const char *value, const char *path);
 
+int replace_link_at( int dirfd, const char *value, const char *path, bool hard, bool exchange);
+
 int read_link( const char *path);
 
 int
 usage( const char *prog)
 {
-    fprintf( stderr, "Usage: (%s -s <from> <to>) or (%s -r <link>)\n", prog, prog);
+    fprintf( stderr, "Usage: (%s -s [-f] [-x] <from> <to>) or (%s -r <link>) or "
+                     "(%s -b [-H] [-f] [-x] [-j <jobs>] [manifest])\n", prog, prog, prog);
     return EXIT_FAILURE;
 }
 
@@ -23,8 +35,54 @@ typedef struct
 {
     bool flag_symbolic;
     bool flag_read;
+    bool flag_batch;
+    bool flag_hard;      // batch: linkat() instead of symlinkat()
+    bool flag_force;     // atomically replace an existing link
+    bool flag_exchange;  // force, keeping the old link as <link>.prev
+    int  jobs;           // batch: worker threads
+    const char *manifest; // batch: NULL or "-" for stdin
 } ln_mode_t;
 
+// Parent directory of some manifest link, opened once, by the first line
+// that creates a link in it
+typedef struct
+{
+    char  *path;
+    size_t len;
+    bool   opened;
+    int    fd;  // AT_FDCWD when it could not be opened, links then use full paths
+    int    err; // errno of the failed open, links in it report that
+} ln_dir_t;
+
+typedef struct
+{
+    ln_dir_t **slots;   // entries stay put while the table grows
+    size_t     capacity; // power of two
+    size_t    count;
+} ln_dir_cache_t;
+
+typedef struct
+{
+    const char *target;
+    const char *link;  // full path, used in messages and when dir has no fd
+    const char *base;  // last component of link
+    ln_dir_t   *dir;   // NULL for links in the current directory
+    size_t      line;
+} ln_entry_t;
+
+typedef struct
+{
+    const ln_mode_t *mode;
+    ln_entry_t      *entries;
+    size_t           count;
+    size_t          *runs;   // starts of same-directory runs, count at the end
+    size_t           nruns;
+    atomic_size_t    next;   // first run not taken by any worker
+    atomic_size_t    failed;
+} ln_batch_t;
+
+int batch_links( const ln_mode_t *mode);
+
 int
 main( int    argc,
       char **argv)
@@ -33,8 +91,52 @@ main( int    argc,
     {
         return usage( argv[0]);
     }
-    ln_mode_t mode = {};
-    if ( strcmp( argv[1], "-s") == 0 ||
+    ln_mode_t mode = { .jobs = 1 };
+    if ( strcmp( argv[1], "-b") == 0 ||
+         strcmp( argv[1], "--batch") == 0 )
+    {
+        mode.flag_batch = true;
+        for ( int i = 2; i < argc; ++i )
+        {
+            if ( strcmp( argv[i], "-H") == 0 ||
+                 strcmp( argv[i], "--hard") == 0 )
+            {
+                mode.flag_hard = true;
+            } else if ( strcmp( argv[i], "-f") == 0 ||
+                        strcmp( argv[i], "--force") == 0 )
+            {
+                mode.flag_force = true;
+            } else if ( strcmp( argv[i], "-x") == 0 ||
+                        strcmp( argv[i], "--exchange") == 0 )
+            {
+                mode.flag_force    = true;
+                mode.flag_exchange = true;
+            } else if ( strcmp( argv[i], "-j") == 0 ||
+                        strcmp( argv[i], "--jobs") == 0 )
+            {
+                if ( i + 1 == argc )
+                {
+                    return usage( argv[0]);
+                }
+                char *end  = NULL;
+                long  jobs = strtol( argv[++i], &end, 10);
+                if ( end == argv[i] || *end != '\0' || jobs < 1 || jobs > MAX_JOBS )
+                {
+                    fprintf( stderr, "%s: invalid job count '%s'\n", argv[0], argv[i]);
+                    return usage( argv[0]);
+                }
+                mode.jobs = (int)jobs;
+            } else if ( mode.manifest == NULL &&
+                        ( argv[i][0] != '-' || argv[i][1] == '\0' ) )
+            {
+                mode.manifest = argv[i];
+            } else
+            {
+                return usage( argv[0]);
+            }
+        }
+        return batch_links( &mode);
+    } else if ( strcmp( argv[1], "-s") == 0 ||
          strcmp( argv[1], "--symbolic") == 0)
     {
         mode.flag_symbolic = true;
@@ -49,11 +151,38 @@ main( int    argc,
 
     if ( mode.flag_symbolic )
     {
-        if ( argc != 4 )
+        int i = 2;
+        for ( ; i < argc && argv[i][0] == '-'; ++i )
+        {
+            if ( strcmp( argv[i], "-f") == 0 ||
+                 strcmp( argv[i], "--force") == 0 )
+            {
+                mode.flag_force = true;
+            } else if ( strcmp( argv[i], "-x") == 0 ||
+                        strcmp( argv[i], "--exchange") == 0 )
+            {
+                mode.flag_force    = true;
+                mode.flag_exchange = true;
+            } else
+            {
+                return usage( argv[0]);
+            }
+        }
+        if ( argc - i != 2 )
         {
             return usage( argv[0]);
         }
-        return create_link( argv[2], argv[3]);
+        if ( mode.flag_force )
+        {
+            int error = replace_link_at( AT_FDCWD, argv[i], argv[i + 1], false, mode.flag_exchange);
+            if ( error != 0 )
+            {
+                fprintf( stderr, "%s: %s\n", argv[i + 1], strerror( error));
+                return EXIT_FAILURE;
+            }
+            return 0;
+        }
+        return create_link( argv[i], argv[i + 1]);
     } else if ( mode.flag_read )
     {
         if ( argc != 3 )
@@ -76,6 +205,92 @@ create_link( const char *value,
     return 0;
 }
 
+// Creates the link under a temporary name in the directory of path and
+// renames it over path, so path resolves to the old or to the new target at
+// every moment. Existing directories are never replaced. With exchange the
+// two are swapped by RENAME_EXCHANGE and the old link is kept as <path>.prev
+// for rollback. Returns 0 or an errno value.
+int
+replace_link_at( int         dirfd,
+                 const char *value,
+                 const char *path,
+                 bool        hard,
+                 bool        exchange)
+{
+    static atomic_uint counter;
+
+    const char *slash  = strrchr( path, '/');
+    int         prefix = ( slash != NULL ) ? (int)( slash - path + 1) : 0;
+    char        tmp[PATH_MAX];
+    char        prev[PATH_MAX];
+    if ( snprintf( prev, sizeof( prev), "%s.prev", path) >= (int)sizeof( prev) )
+    {
+        return ENAMETOOLONG;
+    }
+
+    struct stat st;
+    if ( fstatat( dirfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR( st.st_mode) )
+    {
+        return EISDIR;
+    }
+
+    int result = 0;
+    do
+    {
+        if ( snprintf( tmp, sizeof( tmp), "%.*s.ln.%ld.%u", prefix, path, (long)getpid(),
+                       atomic_fetch_add( &counter, 1)) >= (int)sizeof( tmp) )
+        {
+            return ENAMETOOLONG;
+        }
+        result = ( hard ) ? linkat( AT_FDCWD, value, dirfd, tmp, 0)
+                          : symlinkat( value, dirfd, tmp);
+    } while ( result != 0 && errno == EEXIST );
+    if ( result != 0 )
+    {
+        return errno;
+    }
+
+    int error = 0;
+    if ( exchange )
+    {
+        if ( renameat2( dirfd, tmp, dirfd, path, RENAME_EXCHANGE) == 0 )
+        {
+            // The old link now sits under the temporary name
+            if ( renameat( dirfd, tmp, dirfd, prev) != 0 )
+            {
+                error = errno;
+                unlinkat( dirfd, tmp, 0);
+            }
+            return error;
+        }
+        if ( errno == EINVAL || errno == ENOSYS )
+        {
+            // No exchange on this filesystem, save the old link by hand. The
+            // swap itself below is still atomic.
+            unlinkat( dirfd, prev, 0);
+            if ( linkat( dirfd, path, dirfd, prev, 0) != 0 && errno != ENOENT )
+            {
+                error = errno;
+                unlinkat( dirfd, tmp, 0);
+                return error;
+            }
+        } else if ( errno != ENOENT )
+        {
+            error = errno;
+            unlinkat( dirfd, tmp, 0);
+            return error;
+        }
+    }
+
+    // Nothing to exchange with or no rollback wanted: plain atomic replace
+    if ( renameat( dirfd, tmp, dirfd, path) != 0 )
+    {
+        error = errno;
+        unlinkat( dirfd, tmp, 0);
+    }
+    return error;
+}
+
 int
 read_link( const char *path)
 {
@@ -111,3 +326,383 @@ read_link( const char *path)
     free( buffer);
     return 0;
 }
+
+static uint64_t
+dir_hash( const char *path,
+          size_t      len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for ( size_t i = 0; i != len; ++i )
+    {
+        hash = ( hash ^ (unsigned char)path[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Returns the cached parent directory, opening it on first use
+static ln_dir_t *
+dir_lookup( ln_dir_cache_t *cache,
+            const char     *path,
+            size_t          len)
+{
+    if ( ( cache->count + 1) * 2 > cache->capacity )
+    {
+        size_t     capacity = ( cache->capacity != 0 ) ? cache->capacity * 2 : 256;
+        ln_dir_t **slots    = (ln_dir_t **)calloc( capacity, sizeof( ln_dir_t *));
+        if ( slots == NULL )
+        {
+            return NULL;
+        }
+        for ( size_t i = 0; i != cache->capacity; ++i )
+        {
+            if ( cache->slots[i] == NULL )
+            {
+                continue;
+            }
+            size_t slot = dir_hash( cache->slots[i]->path, cache->slots[i]->len) & ( capacity - 1);
+            while ( slots[slot] != NULL )
+            {
+                slot = ( slot + 1) & ( capacity - 1);
+            }
+            slots[slot] = cache->slots[i];
+        }
+        free( cache->slots);
+        cache->slots    = slots;
+        cache->capacity = capacity;
+    }
+
+    size_t slot = dir_hash( path, len) & ( cache->capacity - 1);
+    while ( cache->slots[slot] != NULL )
+    {
+        ln_dir_t *dir = cache->slots[slot];
+        if ( dir->len == len && memcmp( dir->path, path, len) == 0 )
+        {
+            return dir;
+        }
+        slot = ( slot + 1) & ( cache->capacity - 1);
+    }
+
+    ln_dir_t *dir = (ln_dir_t *)calloc( 1, sizeof( ln_dir_t));
+    if ( dir == NULL || ( dir->path = strndup( path, len)) == NULL )
+    {
+        free( dir);
+        return NULL;
+    }
+    cache->slots[slot] = dir;
+    dir->len = len;
+    dir->fd  = AT_FDCWD;
+    cache->count++;
+    return dir;
+}
+
+// Opens dir when its first link is created rather than while the manifest
+// is parsed, so a parent made by an earlier line (a directory symlink, for
+// one) is already there. Only one thread ever uses a given directory.
+static void
+dir_open( ln_dir_t *dir)
+{
+    if ( dir->opened )
+    {
+        return;
+    }
+    dir->opened = true;
+    dir->fd     = open( dir->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if ( dir->fd < 0 )
+    {
+        dir->err = errno;
+        dir->fd  = AT_FDCWD;
+        if ( dir->err == EMFILE || dir->err == ENFILE )
+        {
+            dir->err = 0; // out of fds, fall back to resolving full paths
+        }
+    }
+}
+
+static void
+dir_cache_free( ln_dir_cache_t *cache)
+{
+    for ( size_t i = 0; i != cache->capacity; ++i )
+    {
+        if ( cache->slots[i] != NULL )
+        {
+            if ( cache->slots[i]->opened && cache->slots[i]->fd != AT_FDCWD )
+            {
+                close( cache->slots[i]->fd);
+            }
+            free( cache->slots[i]->path);
+            free( cache->slots[i]);
+        }
+    }
+    free( cache->slots);
+}
+
+static char *
+read_manifest( const char *name,
+               size_t     *size)
+{
+    FILE *stream = stdin;
+    if ( name != NULL && strcmp( name, "-") != 0 )
+    {
+        stream = fopen( name, "r");
+        if ( stream == NULL )
+        {
+            perror( name);
+            return NULL;
+        }
+    }
+
+    size_t capacity = 1 << 16;
+    char  *buffer   = (char *)malloc( capacity);
+    *size = 0;
+    if ( buffer == NULL )
+    {
+        perror( "Memory allocation failed");
+    }
+    while ( buffer != NULL )
+    {
+        if ( *size + 1 == capacity )
+        {
+            char *grown = (char *)realloc( buffer, capacity * 2);
+            if ( grown == NULL )
+            {
+                perror( "Memory allocation failed");
+                free( buffer);
+                buffer = NULL;
+                break;
+            }
+            buffer    = grown;
+            capacity *= 2;
+        }
+        size_t got = fread( buffer + *size, 1, capacity - 1 - *size, stream);
+        *size += got;
+        if ( got == 0 )
+        {
+            if ( ferror( stream) )
+            {
+                perror( ( stream == stdin ) ? "stdin" : name);
+                free( buffer);
+                buffer = NULL;
+            }
+            break;
+        }
+    }
+    if ( stream != stdin )
+    {
+        fclose( stream);
+    }
+    if ( buffer != NULL )
+    {
+        buffer[*size] = '\0';
+    }
+    return buffer;
+}
+
+static void *
+batch_worker( void *arg)
+{
+    ln_batch_t *batch = (ln_batch_t *)arg;
+    for ( ;; )
+    {
+        size_t run = atomic_fetch_add( &batch->next, 1);
+        if ( run >= batch->nruns )
+        {
+            break;
+        }
+        size_t first = batch->runs[run];
+        size_t last  = batch->runs[run + 1];
+        for ( size_t i = first; i != last; ++i )
+        {
+            const ln_entry_t *entry = &batch->entries[i];
+            int         dirfd = AT_FDCWD;
+            const char *name  = entry->link;
+            if ( entry->dir != NULL )
+            {
+                dir_open( entry->dir);
+            }
+            if ( entry->dir != NULL && entry->dir->err != 0 )
+            {
+                fprintf( stderr, "%s: %s\n", entry->link, strerror( entry->dir->err));
+                atomic_fetch_add( &batch->failed, 1);
+                continue;
+            }
+            if ( entry->dir != NULL && entry->dir->fd != AT_FDCWD )
+            {
+                dirfd = entry->dir->fd;
+                name  = entry->base;
+            }
+            int error = 0;
+            if ( batch->mode->flag_force )
+            {
+                error = replace_link_at( dirfd, entry->target, name,
+                                         batch->mode->flag_hard, batch->mode->flag_exchange);
+            } else if ( ( batch->mode->flag_hard )
+                        ? linkat( AT_FDCWD, entry->target, dirfd, name, 0)
+                        : symlinkat( entry->target, dirfd, name) )
+            {
+                error = errno;
+            }
+            if ( error != 0 )
+            {
+                fprintf( stderr, "%s: %s\n", entry->link, strerror( error));
+                atomic_fetch_add( &batch->failed, 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int
+entry_cmp( const void *a,
+           const void *b)
+{
+    const ln_entry_t *lhs = (const ln_entry_t *)a;
+    const ln_entry_t *rhs = (const ln_entry_t *)b;
+    if ( lhs->dir != rhs->dir )
+    {
+        return ( (uintptr_t)lhs->dir < (uintptr_t)rhs->dir ) ? -1 : 1;
+    }
+    return ( lhs->line < rhs->line ) ? -1 : ( lhs->line > rhs->line );
+}
+
+// Creates every "target\tlinkpath" line of the manifest. Each parent
+// directory is opened once, by its first link, so every link costs a single
+// *at() call relative to a cached fd instead of a full path walk. A parent
+// stays the directory it was at that point: re-pointing it later in the
+// manifest does not move the links that follow. With -j, lines in
+// different directories run in no particular order.
+int
+batch_links( const ln_mode_t *mode)
+{
+    size_t size   = 0;
+    char  *buffer = read_manifest( mode->manifest, &size);
+    if ( buffer == NULL )
+    {
+        return EXIT_FAILURE;
+    }
+
+    size_t lines = 0;
+    for ( char *c = buffer; ( c = memchr( c, '\n', buffer + size - c)) != NULL; ++c )
+    {
+        lines++;
+    }
+    ln_entry_t    *entries = (ln_entry_t *)calloc( lines + 1, sizeof( ln_entry_t));
+    ln_dir_cache_t cache   = {};
+    if ( entries == NULL )
+    {
+        perror( "Memory allocation failed");
+        free( buffer);
+        return EXIT_FAILURE;
+    }
+
+    // Many directories may be held open at once
+    struct rlimit nofile;
+    if ( getrlimit( RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max )
+    {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &nofile);
+    }
+
+    ln_batch_t batch  = { .mode = mode, .entries = entries };
+    size_t     lineno = 0;
+    atomic_init( &batch.next, 0);
+    atomic_init( &batch.failed, 0);
+    for ( char *line = buffer; line < buffer + size; )
+    {
+        char *end = memchr( line, '\n', buffer + size - line);
+        if ( end == NULL )
+        {
+            end = buffer + size;
+        }
+        *end = '\0';
+        lineno++;
+
+        char *tab = strchr( line, '\t');
+        if ( line == end )
+        {
+            line = end + 1;
+            continue;
+        } else if ( tab == NULL || tab == line || tab[1] == '\0' )
+        {
+            fprintf( stderr, "%s:%zu: expected <target>\\t<link>\n",
+                     ( mode->manifest != NULL ) ? mode->manifest : "-", lineno);
+            batch.failed++;
+            line = end + 1;
+            continue;
+        }
+        *tab = '\0';
+
+        ln_entry_t *entry = &entries[batch.count++];
+        entry->target = line;
+        entry->link   = tab + 1;
+        entry->base   = entry->link;
+        entry->line   = lineno;
+        char *slash = strrchr( entry->link, '/');
+        if ( slash != NULL )
+        {
+            entry->base = slash + 1;
+            entry->dir  = dir_lookup( &cache, entry->link,
+                                      ( slash == entry->link ) ? 1 : (size_t)( slash - entry->link));
+            if ( entry->dir == NULL )
+            {
+                perror( "Memory allocation failed");
+                dir_cache_free( &cache);
+                free( entries);
+                free( buffer);
+                return EXIT_FAILURE;
+            }
+        }
+        line = end + 1;
+    }
+
+    // Workers take whole directories, links in one directory serialize on
+    // its inode lock anyway. Manifest order is kept within a directory.
+    size_t single[2] = { 0, batch.count };
+    batch.runs  = single;
+    batch.nruns = 1;
+    if ( mode->jobs > 1 && batch.count != 0 )
+    {
+        qsort( entries, batch.count, sizeof( ln_entry_t), entry_cmp);
+        batch.runs = (size_t *)malloc( ( batch.count + 1) * sizeof( size_t));
+        if ( batch.runs == NULL )
+        {
+            perror( "Memory allocation failed");
+            batch.runs = single;
+        } else
+        {
+            batch.nruns = 0;
+            for ( size_t i = 0; i != batch.count; ++i )
+            {
+                if ( i == 0 || entries[i].dir != entries[i - 1].dir )
+                {
+                    batch.runs[batch.nruns++] = i;
+                }
+            }
+            batch.runs[batch.nruns] = batch.count;
+        }
+    }
+
+    pthread_t threads[MAX_JOBS];
+    int       started = 0;
+    for ( ; started < mode->jobs - 1; ++started )
+    {
+        if ( pthread_create( &threads[started], NULL, batch_worker, &batch) != 0 )
+        {
+            perror( "pthread_create");
+            break;
+        }
+    }
+    batch_worker( &batch);
+    for ( int i = 0; i != started; ++i )
+    {
+        pthread_join( threads[i], NULL);
+    }
+
+    if ( batch.runs != single )
+    {
+        free( batch.runs);
+    }
+    dir_cache_free( &cache);
+    free( entries);
+    free( buffer);
+    return ( atomic_load( &batch.failed) != 0 ) ? EXIT_FAILURE : 0;
+}
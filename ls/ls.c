@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/stat.h>
 #include <dirent.h>
@@ -8,29 +9,122 @@
 #include <stdbool.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
 #include <pwd.h>
 #include <grp.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/inotify.h>
+#include <poll.h>
 
 typedef struct
 {
     bool flag_all;
     bool flag_long;
-    bool flag_inode;     // TODO
-    bool flag_numeric;   // TODO
-    bool flag_recursive; // TODO
-    bool flag_directory; // TODO
+    bool flag_inode;     // d_ino, no stat needed
+    bool flag_numeric;   // ids as numbers, no NSS lookups
+    bool flag_recursive;
+    bool flag_directory; // list operands, not their contents
+    long jobs;           // -R walkers, 1 means the serial walk
+    bool flag_sync_stat; // --sync-stat, never use io_uring
+    bool flag_bench;     // --bench
+    bool flag_unsorted;  // -U, -f: stream in directory order
+    int  sort_by;        // SORT_NAME, or -t, -S, -v
+    const char *cache_dir; // --cache, NULL when off
+    long du_top;         // --du=N, largest subtrees to report, 0 when off
+    bool flag_watch;     // --watch
 } ls_mode_t;
 
+enum
+{
+    SORT_NAME,
+    SORT_TIME,
+    SORT_SIZE,
+    SORT_VERSION,
+};
+
+enum
+{
+    OPT_SYNC_STAT = 256,
+    OPT_BENCH,
+    OPT_CACHE,
+    OPT_DU,
+    OPT_WATCH,
+};
+
+// Fields of an entry needed only by -l, -t, -S and --du (names only by -l)
 typedef struct
 {
-    struct dirent ent;
+    mode_t      mode;
+    nlink_t     nlink;
+    uid_t       uid;
+    gid_t       gid;
+    off_t       size;
+    time_t      mtime;
+    long        mtime_nsec;
+    blkcnt_t    blocks;
+    dev_t       dev;
     const char *user_name;
     const char *group_name;
-    struct stat st;
-} ent_info_t;
+} ls_stat_t;
+
+// What sorting moves around, instead of whole entries. Keys are computed
+// once: the name without its leading dot, and an unsigned number for -t
+// and -S that orders ascending. Equal keys keep directory order.
+typedef struct
+{
+    const char *key;
+    uint64_t    num;
+    uint32_t    index;
+} ls_sort_ent_t;
+
+// Formatted mtime of one minute, the printed part does not change within it
+typedef struct
+{
+    int64_t minute;    // INT64_MIN marks a free slot
+    char    month[16];
+    size_t  month_len;
+    int     mday;
+    char    hhmm[5];
+} ls_time_cache_t;
+
+// Disk usage of a subtree, st_blocks are 512-byte units
+typedef struct
+{
+    uint64_t blocks;
+    uint64_t files;
+} ls_usage_t;
+
+typedef struct
+{
+    char       *path;
+    ls_usage_t  usage;
+} ls_du_ent_t;
+
+// (dev, inode) of multiply linked files already counted, open addressing
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino; // 0 marks a free slot
+} ls_inode_key_t;
 
 typedef struct
 {
+    ls_inode_key_t *slots;
+    size_t          capacity; // power of two
+    size_t          size;
+} ls_inode_set_t;
+
+typedef struct
+{
+    size_t max_sym_inode;
     size_t max_sym_nlink;
     size_t max_sym_uname;
     size_t max_sym_gname;
@@ -38,14 +132,318 @@ typedef struct
     size_t max_sym_day;
 } ls_limit_t;
 
-static const size_t kStartBufferSize = 4;
+// Bump allocator, everything is released at once by arena_free()
+typedef struct ls_arena_chunk_t
+{
+    struct ls_arena_chunk_t *prev;
+    size_t                   used;
+    size_t                   size;
+    char                     data[];
+} ls_arena_chunk_t;
+
+typedef struct
+{
+    ls_arena_chunk_t *top;
+} ls_arena_t;
+
+// Entries of one directory as struct-of-arrays: names, types and inodes
+// are read for every entry, stat details only with -l. Index i refers
+// to the same entry in every array.
+typedef struct
+{
+    size_t         size;
+    size_t         capacity;
+    const char   **names;  // in arena, or in mapping when cached
+    uint8_t       *types;  // DT_* from getdents, refined by stat
+    ino_t         *inodes;
+    ls_stat_t     *stats;  // NULL unless -l
+    ls_sort_ent_t *sorted; // filled by create_ents_arr()
+    ls_arena_t     arena;
+    void          *mapping; // --cache file the names point into
+    size_t         mapping_size;
+    bool           operands; // names are command line paths, always shown
+} ls_dir_t;
+
+// --cache file: header, sorted entries, then the NUL-terminated names.
+// It is valid while the directory's device, inode, mtime and ctime match.
+typedef struct
+{
+    char     magic[4];
+    uint32_t mode_key;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    int64_t  ctime_sec;
+    int64_t  ctime_nsec;
+    uint64_t count;
+    uint64_t names_size;
+} ls_cache_header_t;
+
+typedef struct
+{
+    uint64_t ino;
+    int64_t  size;
+    int64_t  mtime;
+    int64_t  mtime_nsec;
+    int64_t  blocks;
+    uint64_t dev;
+    uint32_t name_offset;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint8_t  type;
+    uint8_t  reserved[3];
+} ls_cache_ent_t;
+
+// --watch state: the listing plus a name -> entry index over it
+typedef struct
+{
+    ls_dir_t    dir;
+    uint32_t   *slots;      // entry + 1, 0 free, kWatchTombstone removed
+    size_t      capacity;   // power of two
+    size_t      used;       // live and removed slots
+    size_t      dead_bytes; // arena bytes of removed names
+    size_t      live_bytes;
+    int         dir_fd;
+    const char *path;
+} ls_watch_t;
+
+typedef struct
+{
+    uint32_t    id;
+    const char *name; // NULL marks a free slot
+} ls_id_name_t;
+
+enum
+{
+    ID_USER,
+    ID_GROUP,
+    ID_NUMBER, // -n, the id itself
+};
+
+// uid or gid -> name, open addressing with linear probing
+typedef struct
+{
+    ls_id_name_t *slots;
+    size_t        capacity; // power of two
+    size_t        size;
+} ls_id_cache_t;
+
+// Directory of the parallel -R walk. Workers list it and create nodes
+// for its subdirectories, the printer prints it once it is ready.
+typedef struct ls_node_t
+{
+    char              *path;
+    ls_dir_t           dir;
+    struct ls_node_t **children;  // recursed subdirectories in sorted order
+    size_t             nchildren;
+    atomic_int         state;     // NODE_PENDING, NODE_READY, NODE_FAILED
+} ls_node_t;
+
+enum
+{
+    NODE_PENDING,
+    NODE_READY,
+    NODE_FAILED,
+};
+
+// Per-worker deque: the owner pushes and pops at the tail (depth first,
+// close to the printing order), thieves take the oldest node at the head
+typedef struct
+{
+    pthread_mutex_t lock;
+    ls_node_t     **items;
+    size_t          head;
+    size_t          tail;
+    size_t          capacity;
+} ls_deque_t;
+
+typedef struct
+{
+    ls_mode_t      *mode;
+    ls_deque_t     *deques;
+    size_t          ndeques;
+    atomic_size_t   queued;   // nodes sitting in deques
+    atomic_size_t   pending;  // nodes not yet listed
+    atomic_size_t   listed;   // listed nodes the printer has not freed yet
+    _Atomic(ls_node_t *) wanted; // node the printer waits for
+    pthread_mutex_t idle_lock;
+    pthread_cond_t  idle_cond;
+    pthread_mutex_t ready_lock;
+    pthread_cond_t  ready_cond;
+} ls_walk_t;
+
+typedef struct
+{
+    ls_walk_t *walk;
+    size_t     self;
+} ls_worker_t;
+
+// Minimal io_uring, rings mapped by hand since there is no liburing
+typedef struct
+{
+    int                  fd;
+    bool                 tried;     // setup was attempted in this thread
+    bool                 no_statx;  // kernel rejected IORING_OP_STATX
+    unsigned int         entries;
+    unsigned int        *sq_head;
+    unsigned int        *sq_tail;
+    unsigned int        *sq_mask;
+    unsigned int        *sq_array;
+    unsigned int        *cq_head;
+    unsigned int        *cq_tail;
+    unsigned int        *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring;
+    size_t               sq_ring_size;
+    void                *cq_ring;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+} ls_uring_t;
+
+// One statx in flight
+typedef struct
+{
+    struct statx stx;
+    size_t       index;
+} ls_uring_slot_t;
+
+static const size_t kStartBufferSize   = 256;
+static const size_t kGetdentsBufferSize = 1 << 16;
+static const size_t kArenaChunkSize    = 1 << 16;
+static const size_t kIdCacheStart      = 64;
+static const unsigned int kUringEntries = 256;
+// Column widths of -l when streaming, longer values push the line right
+static const size_t kStreamSymInode = 8;
+static const size_t kStreamSymNlink = 3;
+static const size_t kStreamSymName  = 8;
+static const size_t kStreamSymSize  = 10;
+static const size_t kStreamSymDay   = 2;
+// strftime("%d") is always two characters
+static const size_t kSymDay         = 2;
+// A directory changed within this many seconds of its mtime/ctime could
+// change again without a visible timestamp change, it is not cached
+static const int64_t kCacheRacySeconds = 2;
+static const char    kCacheMagic[4] = { 'L', 'S', 'C', '2' };
+// Multikey quicksort switches to insertion sort below this
+static const size_t kInsertionSortMax = 16;
+static const uint32_t kWatchTombstone  = UINT32_MAX;
+// Events are collected until the directory is quiet this long, or for
+// at most kWatchMaxBatchMs, and then handled as one batch
+static const int    kWatchSettleMs     = 100;
+static const int    kWatchMaxBatchMs   = 1000;
+// Parallel -R: workers stop listing ahead once this many listed nodes
+// wait for the printer, so memory does not grow with the tree
+static const size_t kWalkWindow = 256;
+// Below this a synchronous statx per entry is cheaper than the batch setup
+static const size_t kUringMinEntries   = 16;
+
+// getpwuid/getgrgid may go to LDAP or sssd for every call and return
+// static buffers, so names are looked up once and kept in an arena
+static ls_arena_t    names_arena = {};
+static ls_id_cache_t user_cache  = {};
+static ls_id_cache_t group_cache = {};
+static ls_id_cache_t number_cache = {}; // -n, shared by uids and gids
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+// One ring per thread, -R workers stat concurrently
+static __thread ls_uring_t uring = { .fd = -1 };
+// Everything on stdout goes through out_*() and leaves in large write()s.
+// Only the printing thread touches these.
+static char            out_buffer[1 << 18];
+static size_t          out_used = 0;
+static ls_time_cache_t time_cache[64];
+static const size_t    kTimeCacheSize = sizeof(time_cache) / sizeof(*time_cache);
+static bool            time_cache_ready = false;
+// --du state, filled by the printing thread in serial walk order, so
+// which link of a file gets counted does not depend on the workers
+static ls_inode_set_t  du_seen  = {};
+static ls_du_ent_t    *du_top   = NULL; // min-heap on blocks
+static size_t          du_ntop  = 0;
 
 int get_flags(int argc, char **argv, ls_mode_t *mode);
-int compare_ents(const void *a, const void *b);
-int create_ents_arr(const char *path, ent_info_t **ents, size_t *size);
-int get_limits(ent_info_t *ents, size_t ents_size, ls_limit_t *limits, ls_mode_t *mode);
-int print_file_info(ent_info_t *ent, ls_mode_t *mode, ls_limit_t *limits, const char *dirname, int depth);
-int print_dir_info(ls_mode_t *mode, const char *dirname, int depth);
+bool needs_stats(ls_mode_t *mode);
+void sort_keys(ls_sort_ent_t *ents, size_t size, size_t depth);
+void insertion_sort_keys(ls_sort_ent_t *ents, size_t size, size_t depth);
+int sort_nums(ls_sort_ent_t *ents, size_t size);
+int compare_version(const void *a, const void *b);
+int create_ents_arr(const char *path, ls_mode_t *mode, ls_dir_t *dir);
+int dir_reserve(ls_dir_t *dir, bool with_stats);
+int read_dir_entries(int dir_fd, const char *path, ls_mode_t *mode, ls_dir_t *dir);
+int stat_dir_entries(int dir_fd, const char *path, ls_mode_t *mode, ls_dir_t *dir);
+ssize_t read_dir_batch(int dir_fd, const char *path, ls_mode_t *mode, ls_dir_t *dir, char *buffer);
+int sort_dir(ls_dir_t *dir, ls_mode_t *mode);
+void clear_dir(ls_dir_t *dir);
+uint32_t cache_mode_key(ls_mode_t *mode);
+int cache_file_path(ls_mode_t *mode, const struct statx *dir_stx, char *path, size_t size);
+int cache_load(ls_mode_t *mode, const struct statx *dir_stx, ls_dir_t *dir);
+int cache_store(ls_mode_t *mode, const struct statx *dir_stx, ls_dir_t *dir);
+void free_dir(ls_dir_t *dir);
+int stream_dir_info(ls_mode_t *mode, const char *dirname, int depth, ls_usage_t *usage);
+int stat_entry(int dir_fd, const char *name, bool follow, unsigned int mask, struct stat *st);
+void statx_to_stat(const struct statx *stx, struct stat *st);
+int store_entry_stat(ls_dir_t *dir, size_t index, const struct stat *st, ls_mode_t *mode);
+int uring_init(ls_uring_t *ring);
+void uring_close(ls_uring_t *ring);
+int uring_stat_entries(ls_uring_t *ring, int dir_fd, const char *path, ls_mode_t *mode, ls_dir_t *dir, unsigned int mask);
+int run_benchmark(ls_mode_t *mode, const char *dirname);
+int get_limits(ls_dir_t *dir, ls_limit_t *limits, ls_mode_t *mode);
+int print_file_info(ls_dir_t *dir, size_t index, ls_mode_t *mode, ls_limit_t *limits, const char *dirname, int depth);
+int print_dir_info(ls_mode_t *mode, const char *dirname, int depth, ls_usage_t *usage);
+int print_dir_entries(ls_mode_t *mode, ls_dir_t *dir, const char *dirname, int depth, ls_walk_t *walk, ls_node_t *node, ls_usage_t *usage);
+int walk_parallel(ls_mode_t *mode, const char *dirname, ls_usage_t *usage);
+ls_node_t *node_create(const char *dirname, const char *name);
+void node_free(ls_node_t *node);
+int list_node(ls_walk_t *walk, size_t self, ls_node_t *node);
+void *walk_worker(void *arg);
+int print_node(ls_walk_t *walk, ls_node_t *node, int depth, ls_usage_t *usage);
+bool walk_into(ls_mode_t *mode, ls_dir_t *dir, size_t index);
+bool du_hidden(ls_mode_t *mode, ls_dir_t *dir, size_t index);
+int du_subtree(ls_mode_t *mode, const char *path, ls_usage_t *usage);
+void du_account(ls_dir_t *dir, size_t index, ls_usage_t *usage);
+size_t inode_hash(uint64_t dev, uint64_t ino);
+bool du_first_link(dev_t dev, ino_t ino);
+void du_record(ls_mode_t *mode, const char *path, const ls_usage_t *usage);
+void du_print(void);
+void du_free(void);
+int compare_du(const void *a, const void *b);
+int deque_push(ls_deque_t *deque, ls_node_t *node);
+ls_node_t *deque_pop(ls_deque_t *deque);
+ls_node_t *deque_steal(ls_deque_t *deque);
+bool deque_take(ls_deque_t *deque, ls_node_t *node);
+ls_node_t *walk_throttle(ls_walk_t *walk);
+void *arena_alloc(ls_arena_t *arena, size_t size);
+char *arena_strndup(ls_arena_t *arena, const char *str, size_t len);
+void arena_free(ls_arena_t *arena);
+const char *get_user_name(uid_t uid, bool numeric);
+const char *get_group_name(gid_t gid, bool numeric);
+int print_operands(ls_mode_t *mode, int count, char **paths, ls_usage_t *usage);
+int print_directory(ls_mode_t *mode, const char *path, ls_usage_t *usage);
+unsigned int stat_mask_for(ls_mode_t *mode);
+int watch_dir(ls_mode_t *mode, const char *path);
+int watch_read_events(ls_mode_t *mode, ls_watch_t *watch, int inotify_fd, bool *done);
+size_t watch_hash(const char *name);
+uint32_t *watch_slot(ls_watch_t *watch, const char *name, bool *found);
+int watch_index_rebuild(ls_watch_t *watch, size_t capacity);
+int watch_add(ls_watch_t *watch, uint32_t index);
+void watch_remove(ls_watch_t *watch, uint32_t *slot);
+int watch_compact(ls_watch_t *watch);
+bool watch_stat_changed(const ls_stat_t *a, const ls_stat_t *b);
+int watch_update(ls_mode_t *mode, ls_watch_t *watch, const char *name, char *change);
+int compare_watch_names(const void *a, const void *b);
+void watch_print(ls_mode_t *mode, ls_watch_t *watch, ls_limit_t *limits, uint32_t index, char prefix);
+void free_name_caches(void);
+void out_flush(void);
+void out_write(const char *str, size_t len);
+void out_char(char c);
+void out_str(const char *str);
+void out_str_right(const char *str, size_t width);
+void out_uint(uint64_t value, size_t width);
+void out_perms(mode_t mode);
+void out_time(time_t mtime, size_t day_width);
+size_t count_digits(uint64_t value);
 
 int
 main(int    argc,
@@ -58,327 +456,2954 @@ main(int    argc,
         return EXIT_FAILURE;
     }
 
-    print_dir_info(&mode, ".", 0);
+    if (mode.flag_bench)
+    {
+        int status = run_benchmark(&mode, ".");
+        uring_close(&uring);
+        free_name_caches();
+        return status;
+    }
 
-    return EXIT_SUCCESS;
+    if (mode.flag_watch)
+    {
+        if (argc - optind > 1)
+        {
+            fprintf(stderr, "--watch takes one directory\n");
+            return EXIT_FAILURE;
+        }
+        int status = watch_dir(&mode, (optind == argc) ? "." : argv[optind]);
+        out_flush();
+        uring_close(&uring);
+        free_name_caches();
+        return status;
+    }
+
+    ls_usage_t usage  = {};
+    int        status = EXIT_SUCCESS;
+    if (optind == argc && !mode.flag_directory)
+    {
+        status = print_directory(&mode, ".", &usage);
+    } else if (optind == argc)
+    {
+        char *current = (char *)".";
+        status = print_operands(&mode, 1, &current, &usage);
+    } else
+    {
+        status = print_operands(&mode, argc - optind, argv + optind, &usage);
+    }
+    if (mode.du_top != 0)
+    {
+        du_print();
+        du_free();
+    }
+
+    out_flush();
+    uring_close(&uring);
+    free_name_caches();
+    return status;
 }
 
+// Files (every operand with -d) are listed first as one group, then each
+// directory, under a "name:" header when there is more than one operand
 int
-print_dir_info(ls_mode_t  *mode,
-               const char *dirname,
-               int         depth)
+print_operands(ls_mode_t   *mode,
+               int          count,
+               char       **paths,
+               ls_usage_t  *usage)
 {
-    ent_info_t *ents = NULL;
-    size_t ents_size = 0;
-    if (create_ents_arr(dirname, &ents, &ents_size) != 0)
-    {
-        return EXIT_FAILURE;
-    }
+    // Command line symlinks are followed unless shown with -l or -d
+    bool follow = !mode->flag_long && !mode->flag_directory;
+    unsigned int stat_mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID |
+                             STATX_SIZE | STATX_MTIME | STATX_INO | STATX_BLOCKS;
 
-    ls_limit_t limits = {};
-    if (get_limits(ents, ents_size, &limits, mode) != 0)
+    int      status = EXIT_SUCCESS;
+    ls_dir_t files  = { .operands = true };
+    bool    *is_dir = (bool *)calloc((size_t)count, sizeof(*is_dir));
+    if (is_dir == NULL)
     {
-        free(ents);
+        perror("calloc");
         return EXIT_FAILURE;
     }
-
-    int file_name_offset = depth;
-    for ( size_t ent = 0; ent != ents_size; ++ent )
+    size_t ndirs = 0;
+    for (int i = 0; i != count; ++i)
     {
-        print_file_info(&ents[ent], mode, &limits, dirname, file_name_offset);
+        struct stat st;
+        if (stat_entry(AT_FDCWD, paths[i], follow, stat_mask, &st) != 0)
+        {
+            fprintf(stderr, "%s: %s\n", paths[i], strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode) && !mode->flag_directory)
+        {
+            is_dir[i] = true;
+            ndirs++;
+            continue;
+        }
 
-        if ((mode->flag_recursive) &&
-            (S_ISDIR(ents[ent].st.st_mode)) &&
-            (ents[ent].ent.d_name[0] != '.'))
+        const char *name = NULL;
+        if (dir_reserve(&files, needs_stats(mode)) != EXIT_SUCCESS ||
+            (name = arena_strndup(&files.arena, paths[i], strlen(paths[i]))) == NULL)
         {
-            printf(":");
-            char filename_buffer[256] = {};
-            snprintf(filename_buffer, 256, "%s/%s", dirname, ents[ent].ent.d_name);
-            print_dir_info(mode, filename_buffer, depth + 1);
-        } else
+            status = EXIT_FAILURE;
+            break;
+        }
+        files.names [files.size] = name;
+        files.inodes[files.size] = st.st_ino;
+        store_entry_stat(&files, files.size, &st, mode);
+        if (files.names[files.size] != NULL)
         {
-            putchar(' ');
+            files.size++;
         }
+    }
 
-        if (mode->flag_long || mode->flag_recursive)
+    bool printed = false;
+    if (files.size != 0)
+    {
+        // Operands are never recursed into, only directories' entries are
+        bool recursive = mode->flag_recursive;
+        mode->flag_recursive = false;
+        if (sort_dir(&files, mode) == EXIT_SUCCESS)
         {
-            putchar('\n');
+            print_dir_entries(mode, &files, NULL, 0, NULL, NULL, usage);
+            printed = true;
         } else
         {
-            file_name_offset = 0;
+            status = EXIT_FAILURE;
         }
+        mode->flag_recursive = recursive;
     }
+    free_dir(&files);
 
-    free(ents);
+    for (int i = 0; i != count; ++i)
+    {
+        if (!is_dir[i])
+        {
+            continue;
+        }
+        if (printed)
+        {
+            out_str((mode->flag_long || mode->flag_recursive) ? "\n" : "\n\n");
+        }
+        if (count > 1)
+        {
+            out_str(paths[i]);
+            out_str(":\n");
+        }
+        if (print_directory(mode, paths[i], usage) != EXIT_SUCCESS)
+        {
+            status = EXIT_FAILURE;
+        }
+        printed = true;
+    }
+    if (printed && count > 1 && !mode->flag_long && !mode->flag_recursive)
+    {
+        out_char('\n');
+    }
+    free(is_dir);
+    return status;
 }
 
+// Lists the directory once, then applies inotify events to the listing:
+// only the names in events are stat'ed again, and every visible change is
+// printed as "+ entry", "- entry" or "~ entry" (changed, -l only)
 int
-print_file_info(ent_info_t *ent,
-                ls_mode_t  *mode,
-                ls_limit_t *limits,
-                const char *dirname,
-                int         depth)
+watch_dir(ls_mode_t  *mode,
+          const char *path)
 {
-    if (ent->ent.d_name[0] == '.' && !mode->flag_all)
+    int inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotify_fd == -1)
     {
-        return 0;
+        perror("inotify_init1");
+        return EXIT_FAILURE;
     }
-
-    for ( int i = 0; i != depth; ++i )
+    // Watched before listing, so nothing between the two is lost
+    uint32_t events = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                      IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+    if (mode->flag_long)
     {
-        putchar('\t');
+        events |= IN_ATTRIB | IN_MODIFY;
     }
-
-    if (!mode->flag_long)
+    if (inotify_add_watch(inotify_fd, path, events) == -1)
     {
-        printf("%s", ent->ent.d_name);
-        return 0;
+        perror(path);
+        close(inotify_fd);
+        return EXIT_FAILURE;
     }
 
-    if      (S_ISREG(ent->st.st_mode)) putchar('-');
-    else if (S_ISDIR(ent->st.st_mode)) putchar('d');
-    else if (S_ISLNK(ent->st.st_mode)) putchar('l');
-    else    printf("(unexpected st.st_mode)");
-
-    // User
-    putchar((ent->st.st_mode & S_IRUSR) ? 'r' : '-');
-    putchar((ent->st.st_mode & S_IWUSR) ? 'w' : '-');
-    putchar((ent->st.st_mode & S_IXUSR) ? 'x' : '-');
-    // Group
-    putchar((ent->st.st_mode & S_IRGRP) ? 'r' : '-');
-    putchar((ent->st.st_mode & S_IWGRP) ? 'w' : '-');
-    putchar((ent->st.st_mode & S_IXGRP) ? 'x' : '-');
-    // Others
-    putchar((ent->st.st_mode & S_IROTH) ? 'r' : '-');
-    putchar((ent->st.st_mode & S_IWOTH) ? 'w' : '-');
-    putchar((ent->st.st_mode & S_IXOTH) ? 'x' : '-');
-
-    // nlinks, user name, group name, size
-    printf(" %*d "
-           "%*s "
-           "%*s "
-           "%*d ",
-           limits->max_sym_nlink, ent->st.st_nlink,
-           limits->max_sym_uname, ent->user_name,
-           limits->max_sym_gname, ent->group_name,
-           limits->max_sym_size,  ent->st.st_size);
-
-    // Last change time
-    time_t mtime_val = ent->st.st_mtime;
-    struct tm *timeinfo = localtime(&mtime_val);
-    char buffer[100];
-    size_t pos = strftime(buffer, sizeof(buffer), "%b ", timeinfo); // %d %H:%M
-    int mday = timeinfo->tm_mday;
-    size_t mday_size = 0;
-    do
+    ls_watch_t watch = { .dir_fd = -1, .path = path };
+    bool recursive = mode->flag_recursive;
+    mode->flag_recursive = false;
+    int status = create_ents_arr(path, mode, &watch.dir);
+    if (status == EXIT_SUCCESS)
     {
-        mday_size++;
-        mday /= 10;
-    } while (mday != 0);
-    memset(buffer + pos, limits->max_sym_day - mday_size, ' ');
-    pos += limits->max_sym_day - mday_size;
-    strftime(buffer + pos, sizeof(buffer) - pos, "%d %H:%M", timeinfo);
-    printf("%s ", buffer);
-
-    // Name
-    printf("%s", ent->ent.d_name);
+        print_dir_entries(mode, &watch.dir, path, 0, NULL, NULL, &(ls_usage_t){});
+        out_char('\n');
+        out_flush();
+    }
+    for (size_t i = 0; status == EXIT_SUCCESS && i != watch.dir.size; ++i)
+    {
+        watch.live_bytes += strlen(watch.dir.names[i]) + 1;
+    }
+    if (status == EXIT_SUCCESS)
+    {
+        status = watch_index_rebuild(&watch, kIdCacheStart);
+    }
 
-    // Link path
-    if (S_ISLNK(ent->st.st_mode))
+    bool done = false;
+    while (status == EXIT_SUCCESS && !done)
     {
-        char buffer[100] = {};
-        ssize_t len = readlink(ent->ent.d_name, buffer, sizeof(buffer) - 1);
-        if (len == -1)
+        struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0)
         {
-            perror(ent->ent.d_name);
-            return 0;
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            status = EXIT_FAILURE;
+            break;
         }
-        printf(" -> %s", buffer);
+        status = watch_read_events(mode, &watch, inotify_fd, &done);
+        out_flush();
     }
+
+    mode->flag_recursive = recursive;
+    free(watch.slots);
+    free_dir(&watch.dir);
+    close(inotify_fd);
+    return status;
 }
 
+// Collects names until the directory settles, then updates each once
 int
-get_flags(int         argc,
-          char      **argv,
-          ls_mode_t  *mode)
+watch_read_events(ls_mode_t  *mode,
+                  ls_watch_t *watch,
+                  int         inotify_fd,
+                  bool       *done)
 {
-    struct option long_options[] = {
-        {      "all", no_argument, NULL, 'a'},
-        {"directory", no_argument, NULL, 'd'},
-        {     "long", no_argument, NULL, 'l'},
-        {    "inode", no_argument, NULL, 'i'},
-        {  "numeric", no_argument, NULL, 'n'},
-        {"recursive", no_argument, NULL, 'R'},
-        {0, 0, 0, 0},
-    };
-
+    char   buffer[1 << 16] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char **names     = NULL;
+    size_t nnames    = 0;
+    size_t capacity  = 0;
+    bool   overflow  = false;
+    int    status    = EXIT_SUCCESS;
 
-    int opt;
-    int option_index = 0;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (true)
+    {
+        ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        } else if (len < 0 && errno != EAGAIN)
+        {
+            perror("read");
+            status = EXIT_FAILURE;
+            break;
+        }
+        for (ssize_t pos = 0; pos < len; )
+        {
+            const struct inotify_event *event = (const struct inotify_event *)(buffer + pos);
+            pos += (ssize_t)(sizeof(*event) + event->len);
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            {
+                *done = true;
+            }
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                overflow = true;
+            }
+            if (event->len == 0 || event->name[0] == '\0' ||
+                (nnames != 0 && strcmp(names[nnames - 1], event->name) == 0))
+            {
+                continue;
+            }
+            if (nnames == capacity)
+            {
+                capacity = (capacity != 0) ? 2 * capacity : kStartBufferSize;
+                char **grown = (char **)realloc(names, capacity * sizeof(*names));
+                if (grown == NULL)
+                {
+                    perror("realloc");
+                    overflow = true;
+                    continue;
+                }
+                names = grown;
+            }
+            names[nnames] = strdup(event->name);
+            if (names[nnames] == NULL)
+            {
+                overflow = true;
+                continue;
+            }
+            nnames++;
+        }
 
-    while ((opt = getopt_long(argc, argv, "adlinR", long_options, &option_index)) != -1) {
-        switch (opt) {
-            case 'a': mode->flag_all       = true; break;
-            case 'l': mode->flag_long      = true; break;
-            case 'i': mode->flag_inode     = true; break;
-            case 'n': mode->flag_numeric   = true; break;
-            case 'R': mode->flag_recursive = true; break;
-            case '?':
-            default:
-                fprintf(stderr, "getopt failed.\n");
-                return EXIT_FAILURE;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+        if (*done || elapsed >= kWatchMaxBatchMs || poll(&pfd, 1, kWatchSettleMs) <= 0)
+        {
+            break;
         }
     }
-    return EXIT_SUCCESS;
-}
-
-int
-compare_ents(const void *a_void,
-             const void *b_void)
-{
-    const ent_info_t *a = (const ent_info_t *)a_void;
-    const ent_info_t *b = (const ent_info_t *)b_void;
-
-    int a_is_special = 0;
-    int b_is_special = 0;
-
-    if      (strcmp(a->ent.d_name, "." ) == 0) a_is_special = 1;
-    else if (strcmp(a->ent.d_name, "..") == 0) a_is_special = 2;
-
-    if      (strcmp(b->ent.d_name, "." ) == 0) b_is_special = 1;
-    else if (strcmp(b->ent.d_name, "..") == 0) b_is_special = 2;
-
-    if (a_is_special && b_is_special) return a_is_special - b_is_special;
-    if (a_is_special)                 return -1;
-    if (b_is_special)                 return 1;
 
-    int offset_a = 0;
-    int offset_b = 0;
-
-    if (a->ent.d_name[0] == '.') offset_a = 1;
-    if (b->ent.d_name[0] == '.') offset_b = 1;
-
-    return strcmp(a->ent.d_name + offset_a, b->ent.d_name + offset_b);
-}
-
-int
-create_ents_arr(const char  *path,
-                ent_info_t **ents,
-                size_t      *size)
-{
-    DIR *dir = opendir(path);
-    if (dir == NULL)
+    // Opened per batch only: an open fd would keep a removed directory
+    // alive and IN_DELETE_SELF would never come
+    if (!*done && status == EXIT_SUCCESS)
     {
-        perror(path);
-        return EXIT_FAILURE;
+        watch->dir_fd = open(watch->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (watch->dir_fd == -1)
+        {
+            // Removed or renamed, the self events are on their way
+            *done = true;
+        }
     }
 
-    size_t ents_capacity = kStartBufferSize;
-    *ents = (ent_info_t*)calloc(ents_capacity, sizeof(**ents));
-    if (*ents == NULL)
-    {
-        perror("calloc");
-        return EXIT_FAILURE;
-    }
-    size_t ents_size = 0;
-    while (true)
+    if (overflow && watch->dir_fd != -1)
     {
-        if (ents_size == ents_capacity)
+        // Events were lost, compare every old and current name instead
+        ls_dir_t current = {};
+        if (read_dir_entries(watch->dir_fd, watch->path, mode, &current) == EXIT_SUCCESS)
         {
-            ent_info_t *new_ents = (ent_info_t *)realloc(*ents, 2 * ents_capacity * sizeof(**ents));
-            if (new_ents == NULL)
+            size_t total = nnames + watch->dir.size + current.size;
+            char **grown = (char **)realloc(names, (total + 1) * sizeof(*names));
+            if (grown != NULL)
             {
-                perror("realloc");
-                free(*ents);
-                *ents = NULL;
-                *size = 0;
-                closedir(dir);
-                return EXIT_FAILURE;
+                names = grown;
+                for (size_t i = 0; i != watch->dir.size; ++i)
+                {
+                    names[nnames++] = strdup(watch->dir.names[i]);
+                }
+                for (size_t i = 0; i != current.size; ++i)
+                {
+                    names[nnames++] = strdup(current.names[i]);
+                }
             }
-            *ents = new_ents;
-            ents_capacity *= 2;
         }
+        free_dir(&current);
+    }
 
-        struct dirent *ent = readdir(dir);
-        if (ent == NULL)
+    // Each name once, and the batch comes out sorted
+    qsort(names, nnames, sizeof(*names), compare_watch_names);
+    char *changes = (char *)calloc(nnames + 1, sizeof(*changes));
+    if (changes == NULL)
+    {
+        perror("calloc");
+        status = EXIT_FAILURE;
+    }
+    bool changed = false;
+    for (size_t i = 0; i != nnames && status == EXIT_SUCCESS && watch->dir_fd != -1; ++i)
+    {
+        if (names[i] != NULL && (i == 0 || strcmp(names[i - 1], names[i]) != 0))
         {
-            break;
+            status  = watch_update(mode, watch, names[i], &changes[i]);
+            changed = changed || changes[i] != 0;
         }
-        (*ents)[ents_size].ent = *ent;
-
-        char filename_buffer[256] = {};
-        snprintf(filename_buffer, 256, "%s/%s", path, (*ents)[ents_size].ent.d_name);
+    }
 
-        if ((*ents)[ents_size].ent.d_type == DT_LNK)
+    // Widths once per batch, removed entries are still in the table
+    if (changed)
+    {
+        ls_limit_t limits = {};
+        get_limits(&watch->dir, &limits, mode);
+        for (size_t i = 0; i != nnames; ++i)
         {
-            if (lstat(filename_buffer, &(*ents)[ents_size].st) != 0)
+            bool found = false;
+            uint32_t *slot = (changes[i] != 0) ? watch_slot(watch, names[i], &found) : NULL;
+            if (found)
             {
-                perror(filename_buffer);
-                continue;
+                watch_print(mode, watch, &limits, *slot - 1, changes[i]);
             }
-        } else
+        }
+        for (size_t i = 0; i != nnames; ++i)
         {
-            if (stat(filename_buffer, &(*ents)[ents_size].st) != 0)
+            bool found = false;
+            uint32_t *slot = (changes[i] == '-') ? watch_slot(watch, names[i], &found) : NULL;
+            if (found)
             {
-                perror(filename_buffer);
-                continue;
+                watch_remove(watch, slot);
             }
         }
-        struct passwd *pw = getpwuid((*ents)[ents_size].st.st_uid);
-        struct group  *gr = getgrgid((*ents)[ents_size].st.st_gid);
-        (*ents)[ents_size].group_name = gr->gr_name;
-        (*ents)[ents_size].user_name  = pw->pw_name;
-        ents_size++;
+    }
+    for (size_t i = 0; i != nnames; ++i)
+    {
+        free(names[i]);
+    }
+    free(names);
+    free(changes);
+    if (watch->dir_fd != -1)
+    {
+        close(watch->dir_fd);
+        watch->dir_fd = -1;
     }
 
-    *size = ents_size;
-
-    qsort(*ents, ents_size, sizeof(**ents), compare_ents);
-    closedir(dir);
-    return EXIT_SUCCESS;
+    if (status == EXIT_SUCCESS && watch->dead_bytes > watch->live_bytes + kArenaChunkSize)
+    {
+        status = watch_compact(watch);
+    }
+    return status;
 }
 
-int
-get_limits(ent_info_t *ents,
-           size_t      ents_size,
-           ls_limit_t *limits,
-           ls_mode_t  *mode)
+size_t
+watch_hash(const char *name)
 {
-    if (!mode->flag_long)
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (; *name != '\0'; ++name)
     {
-        return EXIT_SUCCESS;
+        hash = (hash ^ (unsigned char)*name) * 1099511628211ull;
     }
-    for (size_t i = 0; i != ents_size; ++i)
+    return (size_t)hash;
+}
+
+// Slot holding name, or the free slot where it would go
+uint32_t *
+watch_slot(ls_watch_t *watch,
+           const char *name,
+           bool       *found)
+{
+    size_t mask = watch->capacity - 1;
+    for (size_t slot = watch_hash(name) & mask; ; slot = (slot + 1) & mask)
     {
-        if (ents[i].ent.d_name[0] == '.' && !mode->flag_all)
+        uint32_t value = watch->slots[slot];
+        if (value == 0)
         {
-            continue;
+            *found = false;
+            return &watch->slots[slot];
         }
-        nlink_t st_nlink = ents[i].st.st_nlink;
-        size_t sym_nlink = 0;
-        do
+        if (value != kWatchTombstone && strcmp(watch->dir.names[value - 1], name) == 0)
         {
-            sym_nlink++;
-            st_nlink /= 10;
-        } while (st_nlink != 0);
+            *found = true;
+            return &watch->slots[slot];
+        }
+    }
+}
+
+int
+watch_index_rebuild(ls_watch_t *watch,
+                    size_t      capacity)
+{
+    while (capacity < 2 * (watch->dir.size + 1))
+    {
+        capacity *= 2;
+    }
+    uint32_t *slots = (uint32_t *)calloc(capacity, sizeof(*slots));
+    if (slots == NULL)
+    {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    free(watch->slots);
+    watch->slots    = slots;
+    watch->capacity = capacity;
+    watch->used     = 0;
+    for (size_t i = 0; i != watch->dir.size; ++i)
+    {
+        bool found = false;
+        *watch_slot(watch, watch->dir.names[i], &found) = (uint32_t)i + 1;
+        watch->used++;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Indexes entry index, already stored in watch->dir
+int
+watch_add(ls_watch_t *watch,
+          uint32_t    index)
+{
+    if (2 * (watch->used + 1) > watch->capacity &&
+        watch_index_rebuild(watch, (watch->dir.size * 4 > watch->capacity) ? 2 * watch->capacity
+                                                                          : watch->capacity) != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    bool found = false;
+    *watch_slot(watch, watch->dir.names[index], &found) = index + 1;
+    watch->used++;
+    return EXIT_SUCCESS;
+}
+
+// Drops the entry in slot, the last entry takes its place in the arrays
+void
+watch_remove(ls_watch_t *watch,
+             uint32_t   *slot)
+{
+    ls_dir_t *dir   = &watch->dir;
+    uint32_t  index = *slot - 1;
+    size_t    len   = strlen(dir->names[index]) + 1;
+    watch->dead_bytes += len;
+    watch->live_bytes -= len;
+    *slot = kWatchTombstone;
+
+    uint32_t last = (uint32_t)dir->size - 1;
+    if (index != last)
+    {
+        bool found = false;
+        *watch_slot(watch, dir->names[last], &found) = index + 1;
+        dir->names [index] = dir->names [last];
+        dir->types [index] = dir->types [last];
+        dir->inodes[index] = dir->inodes[last];
+        if (dir->stats != NULL)
+        {
+            dir->stats[index] = dir->stats[last];
+        }
+    }
+    dir->size--;
+}
+
+// Moves the live names into a fresh arena once removed ones dominate
+int
+watch_compact(ls_watch_t *watch)
+{
+    ls_arena_t arena = {};
+    for (size_t i = 0; i != watch->dir.size; ++i)
+    {
+        const char *name = watch->dir.names[i];
+        char *copy = arena_strndup(&arena, name, strlen(name));
+        if (copy == NULL)
+        {
+            arena_free(&arena);
+            return EXIT_FAILURE;
+        }
+        watch->dir.names[i] = copy;
+    }
+    arena_free(&watch->dir.arena);
+    if (watch->dir.mapping != NULL)
+    {
+        munmap(watch->dir.mapping, watch->dir.mapping_size);
+        watch->dir.mapping = NULL;
+    }
+    watch->dir.arena  = arena;
+    watch->dead_bytes = 0;
+    return EXIT_SUCCESS;
+}
+
+bool
+watch_stat_changed(const ls_stat_t *a,
+                   const ls_stat_t *b)
+{
+    return a->mode  != b->mode  || a->nlink != b->nlink || a->uid   != b->uid ||
+           a->gid   != b->gid   || a->size  != b->size  || a->mtime != b->mtime ||
+           a->mtime_nsec != b->mtime_nsec;
+}
+
+// NULL names (failed copies) go last, so duplicates end up adjacent
+int
+compare_watch_names(const void *a,
+                    const void *b)
+{
+    const char *lhs = *(const char * const *)a;
+    const char *rhs = *(const char * const *)b;
+    if (lhs == NULL || rhs == NULL)
+    {
+        return (lhs == NULL) - (rhs == NULL);
+    }
+    return strcmp(lhs, rhs);
+}
+
+// Stats name again and applies it to the table. *change is set to the
+// prefix to print, or 0: '+' added, '~' changed, '-' gone. A gone entry
+// stays in the table until the batch is printed.
+int
+watch_update(ls_mode_t  *mode,
+             ls_watch_t *watch,
+             const char *name,
+             char       *change)
+{
+    ls_dir_t *dir   = &watch->dir;
+    bool      found = false;
+    uint32_t *slot  = watch_slot(watch, name, &found);
+
+    // Not followed: symlinks are listed as links, and for anything else
+    // it makes no difference
+    struct stat st;
+    bool exists = (stat_entry(watch->dir_fd, name, false,
+                              stat_mask_for(mode) | STATX_TYPE | STATX_INO, &st) == 0);
+    if (!exists && errno != ENOENT)
+    {
+        fprintf(stderr, "%s/%s: %s\n", watch->path, name, strerror(errno));
+        return EXIT_SUCCESS;
+    }
+
+    if (!exists)
+    {
+        if (found)
+        {
+            *change = '-';
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (found)
+    {
+        uint32_t    index = *slot - 1;
+        const char *kept  = dir->names[index];
+        ls_stat_t   old   = (dir->stats != NULL) ? dir->stats[index] : (ls_stat_t){};
+        bool replaced = (dir->inodes[index] != st.st_ino);
+        dir->inodes[index] = st.st_ino;
+        if (store_entry_stat(dir, index, &st, mode) != EXIT_SUCCESS)
+        {
+            dir->names[index] = kept; // store_entry_stat() cleared it
+            return EXIT_FAILURE;
+        }
+        // A new inode under the same name is visible with -i too
+        if ((replaced && (mode->flag_long || mode->flag_inode)) ||
+            (mode->flag_long && watch_stat_changed(&old, &dir->stats[index])))
+        {
+            *change = '~';
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (dir_reserve(dir, needs_stats(mode)) != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    size_t len = strlen(name);
+    const char *copy = arena_strndup(&dir->arena, name, len);
+    if (copy == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    uint32_t index = (uint32_t)dir->size;
+    dir->names [index] = copy;
+    dir->inodes[index] = st.st_ino;
+    if (store_entry_stat(dir, index, &st, mode) != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    dir->size++;
+    watch->live_bytes += len + 1;
+    if (watch_add(watch, index) != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    *change = '+';
+    return EXIT_SUCCESS;
+}
+
+void
+watch_print(ls_mode_t  *mode,
+            ls_watch_t *watch,
+            ls_limit_t *limits,
+            uint32_t    index,
+            char        prefix)
+{
+    if (watch->dir.names[index][0] == '.' && !mode->flag_all)
+    {
+        return;
+    }
+    out_char(prefix);
+    out_char(' ');
+    print_file_info(&watch->dir, index, mode, limits, watch->path, 0);
+    out_char('\n');
+}
+
+int
+print_directory(ls_mode_t  *mode,
+                const char *path,
+                ls_usage_t *usage)
+{
+    if (mode->flag_recursive && mode->jobs > 1 && !mode->flag_unsorted)
+    {
+        return walk_parallel(mode, path, usage);
+    }
+    return print_dir_info(mode, path, 0, usage);
+}
+
+int
+print_dir_info(ls_mode_t  *mode,
+               const char *dirname,
+               int         depth,
+               ls_usage_t *usage)
+{
+    if (mode->flag_unsorted)
+    {
+        return stream_dir_info(mode, dirname, depth, usage);
+    }
+
+    ls_dir_t dir = {};
+    if (create_ents_arr(dirname, mode, &dir) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    int status = print_dir_entries(mode, &dir, dirname, depth, NULL, NULL, usage);
+    free_dir(&dir);
+    du_record(mode, dirname, usage);
+    return status;
+}
+
+// Prints every getdents64 batch as soon as it is read and stat'ed, so
+// memory and time to the first line do not depend on the directory size
+int
+stream_dir_info(ls_mode_t  *mode,
+                const char *dirname,
+                int         depth,
+                ls_usage_t *usage)
+{
+    int dir_fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        perror(dirname);
+        return EXIT_FAILURE;
+    }
+    char *buffer = (char *)malloc(kGetdentsBufferSize);
+    if (buffer == NULL)
+    {
+        perror("malloc");
+        close(dir_fd);
+        return EXIT_FAILURE;
+    }
+
+    int      status = EXIT_SUCCESS;
+    ls_dir_t dir    = {};
+    while (true)
+    {
+        clear_dir(&dir);
+        ssize_t read_bytes = read_dir_batch(dir_fd, dirname, mode, &dir, buffer);
+        if (read_bytes <= 0)
+        {
+            status = (read_bytes == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+            break;
+        }
+        if (stat_dir_entries(dir_fd, dirname, mode, &dir) != EXIT_SUCCESS ||
+            sort_dir(&dir, mode) != EXIT_SUCCESS)
+        {
+            status = EXIT_FAILURE;
+            break;
+        }
+        print_dir_entries(mode, &dir, dirname, depth, NULL, NULL, usage);
+        out_flush();
+    }
+
+    free_dir(&dir);
+    free(buffer);
+    close(dir_fd);
+    du_record(mode, dirname, usage);
+    return status;
+}
+
+// Prints a listed directory. Subdirectories are listed on the spot in the
+// serial walk, or taken from node->children when the walk is parallel.
+// With --du the entries are added to usage, subtrees included.
+int
+print_dir_entries(ls_mode_t  *mode,
+                  ls_dir_t   *dir,
+                  const char *dirname,
+                  int         depth,
+                  ls_walk_t  *walk,
+                  ls_node_t  *node,
+                  ls_usage_t *usage)
+{
+    ls_limit_t limits = {};
+    if (get_limits(dir, &limits, mode) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    size_t child = 0;
+    int file_name_offset = depth;
+    for ( size_t ent = 0; ent != dir->size; ++ent )
+    {
+        uint32_t    index = dir->sorted[ent].index;
+        const char *name  = dir->names[index];
+        print_file_info(dir, index, mode, &limits, dirname, file_name_offset);
+
+        if (walk_into(mode, dir, index))
+        {
+            out_char(':');
+            ls_usage_t child_usage = {};
+            if (node == NULL)
+            {
+                char filename_buffer[PATH_MAX] = {};
+                snprintf(filename_buffer, sizeof(filename_buffer), "%s/%s", dirname, name);
+                print_dir_info(mode, filename_buffer, depth + 1, &child_usage);
+            } else if (child != node->nchildren)
+            {
+                print_node(walk, node->children[child], depth + 1, &child_usage);
+                child++;
+            }
+            usage->blocks += child_usage.blocks;
+            usage->files  += child_usage.files;
+        } else
+        {
+            out_char(' ');
+            if (du_hidden(mode, dir, index))
+            {
+                char filename_buffer[PATH_MAX] = {};
+                snprintf(filename_buffer, sizeof(filename_buffer), "%s/%s", dirname, name);
+                du_subtree(mode, filename_buffer, usage);
+            } else if (mode->du_top != 0)
+            {
+                du_account(dir, index, usage);
+            }
+        }
+
+        if (mode->flag_long || mode->flag_recursive)
+        {
+            out_char('\n');
+        } else
+        {
+            file_name_offset = 0;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// Lists the tree with mode->jobs workers while this thread prints nodes
+// in the same order as the serial walk, waiting for each one to be ready
+int
+walk_parallel(ls_mode_t  *mode,
+              const char *dirname,
+              ls_usage_t *usage)
+{
+    ls_node_t *root = node_create(dirname, NULL);
+    if (root == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    ls_walk_t walk = {
+        .mode    = mode,
+        .ndeques = (size_t)mode->jobs,
+    };
+    walk.deques = (ls_deque_t *)calloc(walk.ndeques, sizeof(*walk.deques));
+    ls_worker_t *workers = (ls_worker_t *)calloc(walk.ndeques, sizeof(*workers));
+    pthread_t   *threads = (pthread_t   *)calloc(walk.ndeques, sizeof(*threads));
+    if (walk.deques == NULL || workers == NULL || threads == NULL)
+    {
+        perror("calloc");
+        free(walk.deques);
+        free(workers);
+        free(threads);
+        node_free(root);
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i != walk.ndeques; ++i)
+    {
+        pthread_mutex_init(&walk.deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&walk.idle_lock,  NULL);
+    pthread_cond_init (&walk.idle_cond,  NULL);
+    pthread_mutex_init(&walk.ready_lock, NULL);
+    pthread_cond_init (&walk.ready_cond, NULL);
+
+    int status = EXIT_SUCCESS;
+    atomic_store(&walk.pending, 1);
+    atomic_store(&walk.queued,  1);
+    if (deque_push(&walk.deques[0], root) != EXIT_SUCCESS)
+    {
+        node_free(root);
+        status = EXIT_FAILURE;
+        atomic_store(&walk.pending, 0);
+        atomic_store(&walk.queued,  0);
+    }
+
+    size_t started = 0;
+    for (; started != walk.ndeques && status == EXIT_SUCCESS; ++started)
+    {
+        workers[started].walk = &walk;
+        workers[started].self = started;
+        int error = pthread_create(&threads[started], NULL, walk_worker, &workers[started]);
+        if (error != 0)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(error));
+            break;
+        }
+    }
+
+    if (status == EXIT_SUCCESS)
+    {
+        if (started == 0)
+        {
+            // Nobody to list the tree, the serial walk still can
+            ls_node_t *node = deque_pop(&walk.deques[0]);
+            node_free(node);
+            status = print_dir_info(mode, dirname, 0, usage);
+        } else
+        {
+            status = print_node(&walk, root, 0, usage);
+        }
+    }
+
+    for (size_t i = 0; i != started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t i = 0; i != walk.ndeques; ++i)
+    {
+        free(walk.deques[i].items);
+        pthread_mutex_destroy(&walk.deques[i].lock);
+    }
+    pthread_mutex_destroy(&walk.idle_lock);
+    pthread_cond_destroy (&walk.idle_cond);
+    pthread_mutex_destroy(&walk.ready_lock);
+    pthread_cond_destroy (&walk.ready_cond);
+    free(walk.deques);
+    free(workers);
+    free(threads);
+    return status;
+}
+
+ls_node_t *
+node_create(const char *dirname,
+            const char *name)
+{
+    ls_node_t *node = (ls_node_t *)calloc(1, sizeof(*node));
+    if (node == NULL)
+    {
+        perror("calloc");
+        return NULL;
+    }
+    if (name == NULL)
+    {
+        node->path = strdup(dirname);
+    } else
+    {
+        // Same truncation as the serial walk
+        char filename_buffer[PATH_MAX] = {};
+        snprintf(filename_buffer, sizeof(filename_buffer), "%s/%s", dirname, name);
+        node->path = strdup(filename_buffer);
+    }
+    if (node->path == NULL)
+    {
+        perror("strdup");
+        free(node);
+        return NULL;
+    }
+    atomic_init(&node->state, NODE_PENDING);
+    return node;
+}
+
+// Children are not freed, the printer frees each of them after printing
+void
+node_free(ls_node_t *node)
+{
+    if (node == NULL)
+    {
+        return;
+    }
+    free_dir(&node->dir);
+    free(node->children);
+    free(node->path);
+    free(node);
+}
+
+int
+list_node(ls_walk_t *walk,
+          size_t     self,
+          ls_node_t *node)
+{
+    ls_mode_t *mode  = walk->mode;
+    int        state = NODE_FAILED;
+    atomic_fetch_add(&walk->listed, 1);
+    if (create_ents_arr(node->path, mode, &node->dir) == EXIT_SUCCESS)
+    {
+        state = NODE_READY;
+
+        size_t nchildren = 0;
+        for (size_t ent = 0; ent != node->dir.size; ++ent)
+        {
+            if (walk_into(mode, &node->dir, node->dir.sorted[ent].index))
+            {
+                nchildren++;
+            }
+        }
+        if (nchildren != 0)
+        {
+            node->children = (ls_node_t **)calloc(nchildren, sizeof(*node->children));
+            if (node->children == NULL)
+            {
+                perror("calloc");
+                free_dir(&node->dir);
+                state = NODE_FAILED;
+            }
+        }
+        for (size_t ent = 0; state == NODE_READY && ent != node->dir.size; ++ent)
+        {
+            uint32_t    index = node->dir.sorted[ent].index;
+            const char *name  = node->dir.names[index];
+            if (!walk_into(mode, &node->dir, index))
+            {
+                continue;
+            }
+            ls_node_t *child = node_create(node->path, name);
+            if (child == NULL)
+            {
+                break;
+            }
+            node->children[node->nchildren++] = child;
+        }
+
+        // Reverse order, so the owner pops the first subdirectory next
+        atomic_fetch_add(&walk->pending, node->nchildren);
+        atomic_fetch_add(&walk->queued,  node->nchildren);
+        for (size_t i = node->nchildren; i != 0; --i)
+        {
+            ls_node_t *child = node->children[i - 1];
+            if (deque_push(&walk->deques[self], child) != EXIT_SUCCESS)
+            {
+                // Keep the listing usable, the child just shows up empty.
+                // It is counted as listed, print_node() releases it as such.
+                atomic_fetch_add(&walk->listed, 1);
+                atomic_store(&child->state, NODE_FAILED);
+                atomic_fetch_sub(&walk->pending, 1);
+                atomic_fetch_sub(&walk->queued,  1);
+            }
+        }
+        if (node->nchildren != 0)
+        {
+            pthread_mutex_lock(&walk->idle_lock);
+            pthread_cond_broadcast(&walk->idle_cond);
+            pthread_mutex_unlock(&walk->idle_lock);
+        }
+    }
+
+    // The printer may free the node right after it sees the new state
+    pthread_mutex_lock(&walk->ready_lock);
+    atomic_store(&node->state, state);
+    pthread_cond_broadcast(&walk->ready_cond);
+    pthread_mutex_unlock(&walk->ready_lock);
+
+    if (atomic_fetch_sub(&walk->pending, 1) == 1)
+    {
+        pthread_mutex_lock(&walk->idle_lock);
+        pthread_cond_broadcast(&walk->idle_cond);
+        pthread_mutex_unlock(&walk->idle_lock);
+    }
+    return state == NODE_READY ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void *
+walk_worker(void *arg)
+{
+    ls_worker_t *worker = (ls_worker_t *)arg;
+    ls_walk_t   *walk   = worker->walk;
+    size_t       self   = worker->self;
+
+    while (true)
+    {
+        ls_node_t *node = walk_throttle(walk);
+        if (node == NULL)
+        {
+            node = deque_pop(&walk->deques[self]);
+        }
+        for (size_t i = 1; node == NULL && i != walk->ndeques; ++i)
+        {
+            node = deque_steal(&walk->deques[(self + i) % walk->ndeques]);
+        }
+        if (node != NULL)
+        {
+            atomic_fetch_sub(&walk->queued, 1);
+            list_node(walk, self, node);
+            continue;
+        }
+
+        // queued is raised before the push, so it may be seen a bit early
+        // and the loop goes around once more
+        pthread_mutex_lock(&walk->idle_lock);
+        while (atomic_load(&walk->queued) == 0 && atomic_load(&walk->pending) != 0)
+        {
+            pthread_cond_wait(&walk->idle_cond, &walk->idle_lock);
+        }
+        bool done = (atomic_load(&walk->pending) == 0);
+        pthread_mutex_unlock(&walk->idle_lock);
+        if (done)
+        {
+            break;
+        }
+    }
+    uring_close(&uring);
+    return NULL;
+}
+
+// Holds a worker while kWalkWindow listed nodes wait for the printer. The
+// node the printer waits for is still handed out, otherwise the printer
+// could wait on a node no worker is allowed to list.
+ls_node_t *
+walk_throttle(ls_walk_t *walk)
+{
+    ls_node_t *node = NULL;
+    pthread_mutex_lock(&walk->idle_lock);
+    while (node == NULL && atomic_load(&walk->listed) >= kWalkWindow &&
+           atomic_load(&walk->pending) != 0)
+    {
+        ls_node_t *wanted = atomic_load(&walk->wanted);
+        for (size_t i = 0; wanted != NULL && i != walk->ndeques; ++i)
+        {
+            if (deque_take(&walk->deques[i], wanted))
+            {
+                node = wanted;
+                break;
+            }
+        }
+        if (node == NULL)
+        {
+            pthread_cond_wait(&walk->idle_cond, &walk->idle_lock);
+        }
+    }
+    pthread_mutex_unlock(&walk->idle_lock);
+    return node;
+}
+
+int
+print_node(ls_walk_t  *walk,
+           ls_node_t  *node,
+           int         depth,
+           ls_usage_t *usage)
+{
+    if (atomic_load(&node->state) == NODE_PENDING)
+    {
+        // Lets a throttled worker pick it up
+        pthread_mutex_lock(&walk->idle_lock);
+        atomic_store(&walk->wanted, node);
+        pthread_cond_broadcast(&walk->idle_cond);
+        pthread_mutex_unlock(&walk->idle_lock);
+    }
+    pthread_mutex_lock(&walk->ready_lock);
+    while (atomic_load(&node->state) == NODE_PENDING)
+    {
+        pthread_cond_wait(&walk->ready_cond, &walk->ready_lock);
+    }
+    pthread_mutex_unlock(&walk->ready_lock);
+
+    int status = EXIT_FAILURE;
+    if (atomic_load(&node->state) == NODE_READY)
+    {
+        status = print_dir_entries(walk->mode, &node->dir, node->path, depth, walk, node, usage);
+        du_record(walk->mode, node->path, usage);
+    }
+    node_free(node);
+    if (atomic_fetch_sub(&walk->listed, 1) == kWalkWindow)
+    {
+        pthread_mutex_lock(&walk->idle_lock);
+        pthread_cond_broadcast(&walk->idle_cond);
+        pthread_mutex_unlock(&walk->idle_lock);
+    }
+    return status;
+}
+
+// -R descends into every directory but "." and "..", dot-directories only
+// with -a, the same as GNU ls
+bool
+walk_into(ls_mode_t *mode,
+          ls_dir_t  *dir,
+          size_t     index)
+{
+    const char *name = dir->names[index];
+    if (!mode->flag_recursive || dir->types[index] != DT_DIR)
+    {
+        return false;
+    }
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+    {
+        return false;
+    }
+    return name[0] != '.' || mode->flag_all;
+}
+
+// A dot-directory hidden from the listing still belongs to --du totals
+bool
+du_hidden(ls_mode_t *mode,
+          ls_dir_t  *dir,
+          size_t     index)
+{
+    const char *name = dir->names[index];
+    return mode->du_top != 0 && mode->flag_recursive && !mode->flag_all &&
+           dir->types[index] == DT_DIR && name[0] == '.' &&
+           name[1] != '\0' && !(name[1] == '.' && name[2] == '\0');
+}
+
+// Adds a subtree to usage without printing it, as du would count it
+int
+du_subtree(ls_mode_t  *mode,
+           const char *path,
+           ls_usage_t *usage)
+{
+    ls_dir_t dir = {};
+    if (create_ents_arr(path, mode, &dir) != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    ls_usage_t own = {};
+    for (size_t index = 0; index != dir.size; ++index)
+    {
+        const char *name = dir.names[index];
+        if (dir.types[index] == DT_DIR &&
+            !(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))))
+        {
+            char filename_buffer[PATH_MAX] = {};
+            snprintf(filename_buffer, sizeof(filename_buffer), "%s/%s", path, name);
+            du_subtree(mode, filename_buffer, &own);
+        } else
+        {
+            du_account(&dir, index, &own);
+        }
+    }
+    free_dir(&dir);
+    du_record(mode, path, &own);
+    usage->blocks += own.blocks;
+    usage->files  += own.files;
+    return EXIT_SUCCESS;
+}
+
+// Adds an entry that is not recursed into. A recursed directory is
+// counted by its own "." entry, ".." belongs to the parent.
+void
+du_account(ls_dir_t   *dir,
+           size_t      index,
+           ls_usage_t *usage)
+{
+    const char      *name = dir->names[index];
+    const ls_stat_t *st   = &dir->stats[index];
+    if (name[0] == '.' && name[1] == '.' && name[2] == '\0')
+    {
+        return;
+    }
+    if (!S_ISDIR(st->mode) && st->nlink > 1 && !du_first_link(st->dev, dir->inodes[index]))
+    {
+        return;
+    }
+    usage->blocks += (uint64_t)st->blocks;
+    if (!S_ISDIR(st->mode))
+    {
+        usage->files++;
+    }
+}
+
+size_t
+inode_hash(uint64_t dev,
+           uint64_t ino)
+{
+    return (size_t)(((ino ^ (dev << 40) ^ (dev >> 24)) * 11400714819323198485ull) >> 17);
+}
+
+// True the first time a (dev, inode) pair is seen
+bool
+du_first_link(dev_t dev,
+              ino_t ino)
+{
+    if (2 * (du_seen.size + 1) > du_seen.capacity)
+    {
+        size_t capacity = (du_seen.capacity != 0) ? 2 * du_seen.capacity : kIdCacheStart;
+        ls_inode_key_t *slots = (ls_inode_key_t *)calloc(capacity, sizeof(*slots));
+        if (slots == NULL)
+        {
+            // Counting a link twice is better than failing the listing
+            return true;
+        }
+        for (size_t i = 0; i != du_seen.capacity; ++i)
+        {
+            ls_inode_key_t *old = &du_seen.slots[i];
+            if (old->ino == 0)
+            {
+                continue;
+            }
+            size_t slot = inode_hash(old->dev, old->ino) & (capacity - 1);
+            while (slots[slot].ino != 0)
+            {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            slots[slot] = *old;
+        }
+        free(du_seen.slots);
+        du_seen.slots    = slots;
+        du_seen.capacity = capacity;
+    }
+
+    uint64_t key_dev = (uint64_t)dev;
+    uint64_t key_ino = (uint64_t)ino;
+    size_t slot = inode_hash(key_dev, key_ino) & (du_seen.capacity - 1);
+    while (du_seen.slots[slot].ino != 0)
+    {
+        if (du_seen.slots[slot].ino == key_ino && du_seen.slots[slot].dev == key_dev)
+        {
+            return false;
+        }
+        slot = (slot + 1) & (du_seen.capacity - 1);
+    }
+    du_seen.slots[slot] = (ls_inode_key_t){ .dev = key_dev, .ino = key_ino };
+    du_seen.size++;
+    return true;
+}
+
+// Keeps the mode->du_top largest subtrees in a min-heap
+void
+du_record(ls_mode_t        *mode,
+          const char       *path,
+          const ls_usage_t *usage)
+{
+    if (mode->du_top == 0)
+    {
+        return;
+    }
+    size_t limit = (size_t)mode->du_top;
+    if (du_top == NULL)
+    {
+        du_top = (ls_du_ent_t *)calloc(limit, sizeof(*du_top));
+        if (du_top == NULL)
+        {
+            perror("calloc");
+            mode->du_top = 0;
+            return;
+        }
+    }
+    if (du_ntop == limit && du_top[0].usage.blocks >= usage->blocks)
+    {
+        return;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL)
+    {
+        perror("strdup");
+        return;
+    }
+
+    size_t pos = 0;
+    if (du_ntop < limit)
+    {
+        // Sift up from the new leaf
+        pos = du_ntop++;
+        while (pos != 0 && du_top[(pos - 1) / 2].usage.blocks > usage->blocks)
+        {
+            du_top[pos] = du_top[(pos - 1) / 2];
+            pos = (pos - 1) / 2;
+        }
+    } else
+    {
+        // Replace the smallest and sift down
+        free(du_top[0].path);
+        while (true)
+        {
+            size_t smallest = pos;
+            size_t left     = 2 * pos + 1;
+            size_t right    = 2 * pos + 2;
+            uint64_t blocks = usage->blocks;
+            if (left < du_ntop && du_top[left].usage.blocks < blocks)
+            {
+                smallest = left;
+                blocks   = du_top[left].usage.blocks;
+            }
+            if (right < du_ntop && du_top[right].usage.blocks < blocks)
+            {
+                smallest = right;
+            }
+            if (smallest == pos)
+            {
+                break;
+            }
+            du_top[pos] = du_top[smallest];
+            pos = smallest;
+        }
+    }
+    du_top[pos] = (ls_du_ent_t){ .path = copy, .usage = *usage };
+}
+
+int
+compare_du(const void *a_void,
+           const void *b_void)
+{
+    const ls_du_ent_t *a = (const ls_du_ent_t *)a_void;
+    const ls_du_ent_t *b = (const ls_du_ent_t *)b_void;
+    if (a->usage.blocks != b->usage.blocks)
+    {
+        return (a->usage.blocks < b->usage.blocks) ? 1 : -1;
+    }
+    return strcmp(a->path, b->path);
+}
+
+// du-like lines, largest first: KiB, files, path
+void
+du_print(void)
+{
+    qsort(du_top, du_ntop, sizeof(*du_top), compare_du);
+    out_char('\n');
+    for (size_t i = 0; i != du_ntop; ++i)
+    {
+        out_uint(du_top[i].usage.blocks / 2, 0);
+        out_char('\t');
+        out_uint(du_top[i].usage.files, 0);
+        out_char('\t');
+        out_str(du_top[i].path);
+        out_char('\n');
+    }
+}
+
+void
+du_free(void)
+{
+    for (size_t i = 0; i != du_ntop; ++i)
+    {
+        free(du_top[i].path);
+    }
+    free(du_top);
+    free(du_seen.slots);
+    du_top  = NULL;
+    du_ntop = 0;
+    du_seen = (ls_inode_set_t){};
+}
+
+int
+deque_push(ls_deque_t *deque,
+           ls_node_t  *node)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity)
+    {
+        if (deque->head != 0)
+        {
+            memmove(deque->items, deque->items + deque->head,
+                    (deque->tail - deque->head) * sizeof(*deque->items));
+            deque->tail -= deque->head;
+            deque->head  = 0;
+        } else
+        {
+            size_t capacity = (deque->capacity != 0) ? 2 * deque->capacity : kStartBufferSize;
+            ls_node_t **items = (ls_node_t **)realloc(deque->items, capacity * sizeof(*items));
+            if (items == NULL)
+            {
+                pthread_mutex_unlock(&deque->lock);
+                perror("realloc");
+                return EXIT_FAILURE;
+            }
+            deque->items    = items;
+            deque->capacity = capacity;
+        }
+    }
+    deque->items[deque->tail++] = node;
+    pthread_mutex_unlock(&deque->lock);
+    return EXIT_SUCCESS;
+}
+
+ls_node_t *
+deque_pop(ls_deque_t *deque)
+{
+    ls_node_t *node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail != deque->head)
+    {
+        node = deque->items[--deque->tail];
+    }
+    if (deque->tail == deque->head)
+    {
+        deque->head = deque->tail = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+ls_node_t *
+deque_steal(ls_deque_t *deque)
+{
+    ls_node_t *node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail != deque->head)
+    {
+        node = deque->items[deque->head++];
+    }
+    if (deque->tail == deque->head)
+    {
+        deque->head = deque->tail = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+// Removes a given node wherever it sits, used only when the walk is throttled
+bool
+deque_take(ls_deque_t *deque,
+           ls_node_t  *node)
+{
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    for (size_t i = deque->head; i != deque->tail; ++i)
+    {
+        if (deque->items[i] == node)
+        {
+            memmove(deque->items + i, deque->items + i + 1,
+                    (deque->tail - i - 1) * sizeof(*deque->items));
+            deque->tail--;
+            found = true;
+            break;
+        }
+    }
+    if (deque->tail == deque->head)
+    {
+        deque->head = deque->tail = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+int
+print_file_info(ls_dir_t   *dir,
+                size_t      index,
+                ls_mode_t  *mode,
+                ls_limit_t *limits,
+                const char *dirname,
+                int         depth)
+{
+    const char *name = dir->names[index];
+    if (name[0] == '.' && !mode->flag_all && !dir->operands)
+    {
+        return 0;
+    }
+
+    for ( int i = 0; i != depth; ++i )
+    {
+        out_char('\t');
+    }
+
+    if (mode->flag_inode)
+    {
+        out_uint(dir->inodes[index], limits->max_sym_inode);
+        out_char(' ');
+    }
+
+    if (!mode->flag_long)
+    {
+        out_str(name);
+        return 0;
+    }
+
+    const ls_stat_t *st = &dir->stats[index];
+    if      (S_ISREG(st->mode)) out_char('-');
+    else if (S_ISDIR(st->mode)) out_char('d');
+    else if (S_ISLNK(st->mode)) out_char('l');
+    else    out_str("(unexpected st.st_mode)");
+    out_perms(st->mode);
+
+    // nlinks, user name, group name, size
+    out_char(' ');
+    out_uint(st->nlink, limits->max_sym_nlink);
+    out_char(' ');
+    out_str_right(st->user_name, limits->max_sym_uname);
+    out_char(' ');
+    out_str_right(st->group_name, limits->max_sym_gname);
+    out_char(' ');
+    out_uint((uint64_t)st->size, limits->max_sym_size);
+    out_char(' ');
+
+    // Last change time
+    out_time(st->mtime, limits->max_sym_day);
+    out_char(' ');
+
+    // Name
+    out_str(name);
+
+    // Link path
+    if (S_ISLNK(st->mode))
+    {
+        char path[PATH_MAX] = {};
+        if (dir->operands)
+        {
+            snprintf(path, sizeof(path), "%s", name);
+        } else
+        {
+            snprintf(path, sizeof(path), "%s/%s", dirname, name);
+        }
+        char buffer[PATH_MAX] = {};
+        ssize_t len = readlink(path, buffer, sizeof(buffer) - 1);
+        if (len == -1)
+        {
+            perror(path);
+            return 0;
+        }
+        out_str(" -> ");
+        out_write(buffer, (size_t)len);
+    }
+    return 0;
+}
+
+void
+out_flush(void)
+{
+    size_t done = 0;
+    while (done != out_used)
+    {
+        ssize_t written = write(STDOUT_FILENO, out_buffer + done, out_used - done);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("write");
+            break;
+        }
+        done += (size_t)written;
+    }
+    out_used = 0;
+}
+
+void
+out_write(const char *str,
+          size_t      len)
+{
+    if (len > sizeof(out_buffer) - out_used)
+    {
+        out_flush();
+        if (len > sizeof(out_buffer))
+        {
+            // Cannot happen with PATH_MAX and NAME_MAX sized pieces
+            len = sizeof(out_buffer);
+        }
+    }
+    memcpy(out_buffer + out_used, str, len);
+    out_used += len;
+}
+
+void
+out_char(char c)
+{
+    if (out_used == sizeof(out_buffer))
+    {
+        out_flush();
+    }
+    out_buffer[out_used++] = c;
+}
+
+void
+out_str(const char *str)
+{
+    out_write(str, strlen(str));
+}
+
+void
+out_str_right(const char *str,
+              size_t      width)
+{
+    size_t len = strlen(str);
+    for (; width > len; --width)
+    {
+        out_char(' ');
+    }
+    out_write(str, len);
+}
+
+void
+out_uint(uint64_t value,
+         size_t   width)
+{
+    char   digits[20];
+    size_t len = 0;
+    do
+    {
+        digits[sizeof(digits) - ++len] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    for (; width > len; --width)
+    {
+        out_char(' ');
+    }
+    out_write(digits + sizeof(digits) - len, len);
+}
+
+void
+out_perms(mode_t mode)
+{
+    char perms[9];
+    static const char kSymbols[] = "rwxrwxrwx";
+    for (int bit = 0; bit != 9; ++bit)
+    {
+        perms[bit] = (mode & (S_IRUSR >> bit)) ? kSymbols[bit] : '-';
+    }
+    out_write(perms, sizeof(perms));
+}
+
+// "%b %e %H:%M" with the day padded to day_width. localtime_r() and
+// strftime() run once per distinct minute instead of once per entry.
+void
+out_time(time_t mtime,
+         size_t day_width)
+{
+    if (!time_cache_ready)
+    {
+        for (size_t i = 0; i != kTimeCacheSize; ++i)
+        {
+            time_cache[i].minute = INT64_MIN;
+        }
+        time_cache_ready = true;
+    }
+
+    int64_t minute = (int64_t)mtime / 60 - ((int64_t)mtime % 60 < 0);
+    ls_time_cache_t *slot = &time_cache[(uint64_t)minute % kTimeCacheSize];
+    if (slot->minute != minute)
+    {
+        struct tm timeinfo;
+        if (localtime_r(&mtime, &timeinfo) == NULL)
+        {
+            memset(&timeinfo, 0, sizeof(timeinfo));
+        }
+        slot->minute    = minute;
+        slot->month_len = strftime(slot->month, sizeof(slot->month), "%b", &timeinfo);
+        slot->mday      = timeinfo.tm_mday;
+        char hhmm[8];
+        strftime(hhmm, sizeof(hhmm), "%H:%M", &timeinfo);
+        memcpy(slot->hhmm, hhmm, sizeof(slot->hhmm));
+    }
+
+    out_write(slot->month, slot->month_len);
+    out_char(' ');
+    out_uint((uint64_t)slot->mday, day_width);
+    out_char(' ');
+    out_write(slot->hhmm, sizeof(slot->hhmm));
+}
+
+size_t
+count_digits(uint64_t value)
+{
+    size_t digits = 1;
+    while (value >= 10)
+    {
+        digits++;
+        value /= 10;
+    }
+    return digits;
+}
+
+int
+get_flags(int         argc,
+          char      **argv,
+          ls_mode_t  *mode)
+{
+    struct option long_options[] = {
+        {      "all", no_argument, NULL, 'a'},
+        {"directory", no_argument, NULL, 'd'},
+        {     "long", no_argument, NULL, 'l'},
+        {    "inode", no_argument, NULL, 'i'},
+        {  "numeric", no_argument, NULL, 'n'},
+        {"recursive", no_argument, NULL, 'R'},
+        {     "time", no_argument, NULL, 't'},
+        {     "size", no_argument, NULL, 'S'},
+        {  "version", no_argument, NULL, 'v'},
+        { "unsorted", no_argument, NULL, 'U'},
+        {     "jobs", required_argument, NULL, 'j'},
+        {"sync-stat", no_argument, NULL, OPT_SYNC_STAT},
+        {    "bench", no_argument, NULL, OPT_BENCH},
+        {    "cache", optional_argument, NULL, OPT_CACHE},
+        {       "du", optional_argument, NULL, OPT_DU},
+        {    "watch", no_argument, NULL, OPT_WATCH},
+        {0, 0, 0, 0},
+    };
+
+
+    int opt;
+    int option_index = 0;
+
+    while ((opt = getopt_long(argc, argv, "adlinRUftSvj:", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'a': mode->flag_all       = true; break;
+            case 'd': mode->flag_directory = true; break;
+            case 'l': mode->flag_long      = true; break;
+            case 'i': mode->flag_inode     = true; break;
+            case 'n': mode->flag_numeric   = true; break;
+            case 'R': mode->flag_recursive = true; break;
+            case 'U': mode->flag_unsorted  = true; break;
+            case 't': mode->sort_by = SORT_TIME;    break;
+            case 'S': mode->sort_by = SORT_SIZE;    break;
+            case 'v': mode->sort_by = SORT_VERSION; break;
+            case 'f': mode->flag_unsorted  = true;
+                      mode->flag_all       = true; break;
+            case OPT_SYNC_STAT: mode->flag_sync_stat = true; break;
+            case OPT_BENCH:     mode->flag_bench     = true; break;
+            case OPT_CACHE:
+            {
+                // $XDG_CACHE_HOME/ls or ~/.cache/ls unless given
+                static char cache_dir[PATH_MAX] = {};
+                const char *xdg  = getenv("XDG_CACHE_HOME");
+                const char *home = getenv("HOME");
+                if (optarg != NULL)
+                {
+                    snprintf(cache_dir, sizeof(cache_dir), "%s", optarg);
+                } else if (xdg != NULL && xdg[0] != '\0')
+                {
+                    snprintf(cache_dir, sizeof(cache_dir), "%s/ls", xdg);
+                } else if (home != NULL && home[0] != '\0')
+                {
+                    snprintf(cache_dir, sizeof(cache_dir), "%s/.cache", home);
+                    mkdir(cache_dir, 0700);
+                    snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/ls", home);
+                } else
+                {
+                    fprintf(stderr, "--cache: no $XDG_CACHE_HOME or $HOME, give a directory\n");
+                    return EXIT_FAILURE;
+                }
+                mode->cache_dir = cache_dir;
+                break;
+            }
+            case OPT_WATCH:     mode->flag_watch     = true; break;
+            case OPT_DU:
+            {
+                // Implies -R, the sums come out of the recursive walk
+                char *end = NULL;
+                mode->du_top = (optarg != NULL) ? strtol(optarg, &end, 10) : 10;
+                if (optarg != NULL && (*optarg == '\0' || *end != '\0' || mode->du_top < 1))
+                {
+                    fprintf(stderr, "invalid number of subtrees: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                mode->flag_recursive = true;
+                break;
+            }
+            case 'j':
+            {
+                char *end = NULL;
+                mode->jobs = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || mode->jobs < 1)
+                {
+                    fprintf(stderr, "invalid number of jobs: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case '?':
+            default:
+                fprintf(stderr, "getopt failed.\n");
+                return EXIT_FAILURE;
+        }
+    }
+    if (mode->flag_directory)
+    {
+        mode->flag_recursive = false;
+    }
+    if (mode->jobs == 0)
+    {
+        // The parallel walk is opt-in with -j
+        mode->jobs = 1;
+    }
+    return EXIT_SUCCESS;
+}
+
+int
+compare_version(const void *a_void,
+                const void *b_void)
+{
+    const ls_sort_ent_t *a = (const ls_sort_ent_t *)a_void;
+    const ls_sort_ent_t *b = (const ls_sort_ent_t *)b_void;
+
+    int result = strverscmp(a->key, b->key);
+    if (result != 0)
+    {
+        return result;
+    }
+    return (a->index > b->index) - (a->index < b->index);
+}
+
+// statx() with only the fields in mask, relative to dir_fd. Fields that
+// were not requested stay zero in st.
+int
+stat_entry(int           dir_fd,
+           const char   *name,
+           bool          follow,
+           unsigned int  mask,
+           struct stat  *st)
+{
+    int flags = AT_NO_AUTOMOUNT | (follow ? 0 : AT_SYMLINK_NOFOLLOW);
+    struct statx stx;
+    if (statx(dir_fd, name, flags, mask, &stx) != 0)
+    {
+        if (errno != ENOSYS)
+        {
+            return -1;
+        }
+        return fstatat(dir_fd, name, st, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+    }
+    statx_to_stat(&stx, st);
+    return 0;
+}
+
+void
+statx_to_stat(const struct statx *stx,
+              struct stat        *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode          = stx->stx_mode;
+    st->st_nlink         = stx->stx_nlink;
+    st->st_uid           = stx->stx_uid;
+    st->st_gid           = stx->stx_gid;
+    st->st_size          = stx->stx_size;
+    st->st_ino           = stx->stx_ino;
+    st->st_blocks        = stx->stx_blocks;
+    st->st_dev           = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_mtim.tv_sec   = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec  = stx->stx_mtime.tv_nsec;
+}
+
+int
+dir_reserve(ls_dir_t *dir,
+            bool      with_stats)
+{
+    if (dir->size != dir->capacity)
+    {
+        return EXIT_SUCCESS;
+    }
+    size_t capacity = (dir->capacity != 0) ? 2 * dir->capacity : kStartBufferSize;
+
+    const char **names  = (const char **)realloc(dir->names,  capacity * sizeof(*names));
+    if (names  != NULL) dir->names  = names;
+    uint8_t     *types  = (uint8_t     *)realloc(dir->types,  capacity * sizeof(*types));
+    if (types  != NULL) dir->types  = types;
+    ino_t       *inodes = (ino_t       *)realloc(dir->inodes, capacity * sizeof(*inodes));
+    if (inodes != NULL) dir->inodes = inodes;
+    ls_stat_t   *stats  = NULL;
+    if (with_stats)
+    {
+        stats = (ls_stat_t *)realloc(dir->stats, capacity * sizeof(*stats));
+        if (stats != NULL) dir->stats = stats;
+    }
+    if (names == NULL || types == NULL || inodes == NULL || (with_stats && stats == NULL))
+    {
+        perror("realloc");
+        return EXIT_FAILURE;
+    }
+    dir->capacity = capacity;
+    return EXIT_SUCCESS;
+}
+
+// Reads the whole directory with getdents64 into large buffers, only
+// names (into the arena), types and inode numbers are kept
+int
+read_dir_entries(int         dir_fd,
+                 const char *path,
+                 ls_mode_t  *mode,
+                 ls_dir_t   *dir)
+{
+    char *buffer = (char *)malloc(kGetdentsBufferSize);
+    if (buffer == NULL)
+    {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    ssize_t read_bytes = 0;
+    do
+    {
+        read_bytes = read_dir_batch(dir_fd, path, mode, dir, buffer);
+    } while (read_bytes > 0);
+    free(buffer);
+    return (read_bytes == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// One getdents64 call, appends its entries to dir. Returns the number of
+// bytes read, 0 at the end of the directory and -1 on errors.
+ssize_t
+read_dir_batch(int         dir_fd,
+               const char *path,
+               ls_mode_t  *mode,
+               ls_dir_t   *dir,
+               char       *buffer)
+{
+    ssize_t read_bytes = getdents64(dir_fd, buffer, kGetdentsBufferSize);
+    if (read_bytes < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    for (ssize_t pos = 0; pos < read_bytes; )
+    {
+        struct dirent64 *ent = (struct dirent64 *)(buffer + pos);
+        pos += ent->d_reclen;
+
+        if (dir_reserve(dir, needs_stats(mode)) != EXIT_SUCCESS)
+        {
+            return -1;
+        }
+        const char *name = arena_strndup(&dir->arena, ent->d_name, strlen(ent->d_name));
+        if (name == NULL)
+        {
+            return -1;
+        }
+        dir->names [dir->size] = name;
+        dir->types [dir->size] = ent->d_type;
+        dir->inodes[dir->size] = ent->d_ino;
+        dir->size++;
+    }
+    return read_bytes;
+}
+
+// Stats what the mode needs. Entries that cannot be stat'ed are dropped.
+int
+stat_dir_entries(int         dir_fd,
+                 const char *path,
+                 ls_mode_t  *mode,
+                 ls_dir_t   *dir)
+{
+    unsigned int stat_mask = stat_mask_for(mode);
+    if (stat_mask == 0)
+    {
+        return EXIT_SUCCESS;
+    }
+
+    // Results are stored in place, failed entries get a NULL name
+    if (!mode->flag_sync_stat &&
+        dir->size >= kUringMinEntries &&
+        uring_init(&uring) == EXIT_SUCCESS)
+    {
+        if (uring_stat_entries(&uring, dir_fd, path, mode, dir, stat_mask) != EXIT_SUCCESS)
+        {
+            return EXIT_FAILURE;
+        }
+    } else
+    {
+        for (size_t i = 0; i != dir->size; ++i)
+        {
+            const char *name = dir->names[i];
+            uint8_t     type = dir->types[i];
+            if (stat_mask == STATX_TYPE && type != DT_UNKNOWN)
+            {
+                continue;
+            }
+
+            // Symlinks are shown as links, everything else as its target
+            struct stat st;
+            if (stat_entry(dir_fd, name, type != DT_LNK, stat_mask, &st) != 0)
+            {
+                fprintf(stderr, "%s/%s: %s\n", path, name, strerror(errno));
+                dir->names[i] = NULL;
+                continue;
+            }
+            store_entry_stat(dir, i, &st, mode);
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i != dir->size; ++i)
+    {
+        if (dir->names[i] == NULL)
+        {
+            continue;
+        }
+        dir->names [kept] = dir->names[i];
+        dir->types [kept] = dir->types[i];
+        dir->inodes[kept] = dir->inodes[i];
+        if (needs_stats(mode))
+        {
+            dir->stats[kept] = dir->stats[i];
+        }
+        kept++;
+    }
+    dir->size = kept;
+    return EXIT_SUCCESS;
+}
+
+// statx fields the mode shows or sorts by, 0 when names are enough
+unsigned int
+stat_mask_for(ls_mode_t *mode)
+{
+    // Plain listing needs names only, and the type (known from d_type
+    // on most filesystems) for recursion
+    unsigned int stat_mask = 0;
+    if (mode->flag_long)
+    {
+        stat_mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID |
+                    STATX_GID  | STATX_SIZE | STATX_MTIME;
+    } else if (mode->flag_recursive)
+    {
+        stat_mask = STATX_TYPE;
+    }
+    if (!mode->flag_unsorted && mode->sort_by == SORT_TIME)
+    {
+        stat_mask |= STATX_TYPE | STATX_MTIME;
+    } else if (!mode->flag_unsorted && mode->sort_by == SORT_SIZE)
+    {
+        stat_mask |= STATX_TYPE | STATX_SIZE;
+    }
+    if (mode->du_top != 0)
+    {
+        stat_mask |= STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_BLOCKS;
+    }
+    return stat_mask;
+}
+
+int
+store_entry_stat(ls_dir_t          *dir,
+                 size_t             index,
+                 const struct stat *st,
+                 ls_mode_t         *mode)
+{
+    dir->types[index] = IFTODT(st->st_mode);
+    if (!needs_stats(mode))
+    {
+        return EXIT_SUCCESS;
+    }
+    ls_stat_t *info  = &dir->stats[index];
+    info->mode       = st->st_mode;
+    info->nlink      = st->st_nlink;
+    info->uid        = st->st_uid;
+    info->gid        = st->st_gid;
+    info->size       = st->st_size;
+    info->mtime      = st->st_mtim.tv_sec;
+    info->mtime_nsec = st->st_mtim.tv_nsec;
+    info->blocks     = st->st_blocks;
+    info->dev        = st->st_dev;
+    if (!mode->flag_long)
+    {
+        return EXIT_SUCCESS;
+    }
+    info->user_name  = get_user_name(st->st_uid, mode->flag_numeric);
+    info->group_name = get_group_name(st->st_gid, mode->flag_numeric);
+    if (info->user_name == NULL || info->group_name == NULL)
+    {
+        dir->names[index] = NULL;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int
+uring_init(ls_uring_t *ring)
+{
+    if (ring->tried)
+    {
+        return (ring->fd >= 0 && !ring->no_statx) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    ring->tried = true;
+
+    struct io_uring_params params = {};
+    int fd = (int)syscall(__NR_io_uring_setup, kUringEntries, &params);
+    if (fd < 0)
+    {
+        // Old kernel, seccomp or kernel.io_uring_disabled, stay synchronous
+        return EXIT_FAILURE;
+    }
+    ring->fd           = fd;
+    ring->entries      = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        uring_close(ring);
+        return EXIT_FAILURE;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    } else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            ring->cq_ring = NULL;
+            uring_close(ring);
+            return EXIT_FAILURE;
+        }
+    }
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        uring_close(ring);
+        return EXIT_FAILURE;
+    }
+
+    char *sq = (char *)ring->sq_ring;
+    char *cq = (char *)ring->cq_ring;
+    ring->sq_head  = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head  = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail  = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask  = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return EXIT_SUCCESS;
+}
+
+void
+uring_close(ls_uring_t *ring)
+{
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+    bool no_statx = ring->no_statx;
+    *ring = (ls_uring_t){ .fd = -1, .tried = true, .no_statx = no_statx };
+}
+
+// Keeps up to ring->entries IORING_OP_STATX requests in flight, refilling
+// slots as completions arrive. Same results as the synchronous loop in
+// stat_dir_entries(), including which entries are skipped.
+int
+uring_stat_entries(ls_uring_t *ring,
+                   int         dir_fd,
+                   const char *path,
+                   ls_mode_t  *mode,
+                   ls_dir_t   *dir,
+                   unsigned    mask)
+{
+    size_t nslots = ring->entries;
+    ls_uring_slot_t *slots = (ls_uring_slot_t *)malloc(nslots * sizeof(*slots));
+    size_t          *free_slots = (size_t *)malloc(nslots * sizeof(*free_slots));
+    if (slots == NULL || free_slots == NULL)
+    {
+        perror("malloc");
+        free(slots);
+        free(free_slots);
+        return EXIT_FAILURE;
+    }
+    size_t nfree = nslots;
+    for (size_t i = 0; i != nslots; ++i)
+    {
+        free_slots[i] = i;
+    }
+
+    size_t next     = 0;
+    size_t inflight = 0;
+    while (true)
+    {
+        unsigned int tail = *ring->sq_tail;
+        while (nfree != 0 && next != dir->size)
+        {
+            size_t index = next++;
+            if (mask == STATX_TYPE && dir->types[index] != DT_UNKNOWN)
+            {
+                continue;
+            }
+            size_t slot = free_slots[--nfree];
+            slots[slot].index = index;
+
+            unsigned int sq_index = tail & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[sq_index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode      = IORING_OP_STATX;
+            sqe->fd          = dir_fd;
+            sqe->addr        = (uint64_t)(uintptr_t)dir->names[index];
+            sqe->len         = mask;
+            sqe->off         = (uint64_t)(uintptr_t)&slots[slot].stx;
+            sqe->statx_flags = AT_NO_AUTOMOUNT |
+                               ((dir->types[index] == DT_LNK) ? AT_SYMLINK_NOFOLLOW : 0);
+            sqe->user_data   = slot;
+            ring->sq_array[sq_index] = sq_index;
+            tail++;
+            inflight++;
+        }
+        atomic_store_explicit((_Atomic unsigned int *)ring->sq_tail, tail, memory_order_release);
+        if (inflight == 0)
+        {
+            break;
+        }
+
+        unsigned int to_submit = tail - atomic_load_explicit((_Atomic unsigned int *)ring->sq_head,
+                                                             memory_order_acquire);
+        if (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            // Requests still in flight may write into slots, so they are
+            // not freed; the ring is dropped for the rest of the run
+            perror("io_uring_enter");
+            free(free_slots);
+            uring_close(ring);
+            return EXIT_FAILURE;
+        }
+
+        unsigned int head = *ring->cq_head;
+        unsigned int cq_tail = atomic_load_explicit((_Atomic unsigned int *)ring->cq_tail,
+                                                    memory_order_acquire);
+        for (; head != cq_tail; ++head)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            size_t      slot  = (size_t)cqe->user_data;
+            size_t      index = slots[slot].index;
+            const char *name  = dir->names[index];
+            free_slots[nfree++] = slot;
+            inflight--;
+
+            struct stat st;
+            if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+            {
+                // Kernel without IORING_OP_STATX, finish synchronously
+                ring->no_statx = true;
+                if (stat_entry(dir_fd, name, dir->types[index] != DT_LNK, mask, &st) != 0)
+                {
+                    fprintf(stderr, "%s/%s: %s\n", path, name, strerror(errno));
+                    dir->names[index] = NULL;
+                    continue;
+                }
+            } else if (cqe->res < 0)
+            {
+                fprintf(stderr, "%s/%s: %s\n", path, name, strerror(-cqe->res));
+                dir->names[index] = NULL;
+                continue;
+            } else
+            {
+                statx_to_stat(&slots[slot].stx, &st);
+            }
+            store_entry_stat(dir, index, &st, mode);
+        }
+        atomic_store_explicit((_Atomic unsigned int *)ring->cq_head, head, memory_order_release);
+    }
+
+    free(slots);
+    free(free_slots);
+    return EXIT_SUCCESS;
+}
+
+// Lists dirname with the -l stat set, synchronously and through io_uring
+int
+run_benchmark(ls_mode_t  *mode,
+              const char *dirname)
+{
+    static const char *names[2] = { "statx", "io_uring" };
+    double msec[2]    = {};
+    size_t entries[2] = {};
+
+    mode->flag_long = true;
+    for (int run = 0; run != 2; ++run)
+    {
+        mode->flag_sync_stat = (run == 0);
+        if (run == 1 && uring_init(&uring) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "io_uring is not available\n");
+            return EXIT_FAILURE;
+        }
+
+        ls_dir_t dir = {};
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int status = create_ents_arr(dirname, mode, &dir);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (status != EXIT_SUCCESS)
+        {
+            return EXIT_FAILURE;
+        }
+        entries[run] = dir.size;
+        msec[run]    = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        free_dir(&dir);
+    }
+
+    printf("╔═══════════════════════════════════════╗\n"
+           "║ Stat benchmark, %s\n", dirname);
+    for (int run = 0; run != 2; ++run)
+    {
+        printf("╟───────────────────────────────────────╢\n"
+               "║\t%s:\n"
+               "║\t\t-time:    %lg ms\n"
+               "║\t\t-entries: %zu\n"
+               "║\t\t-speed:   %lg entries/ms\n",
+               names[run],
+               msec[run],
+               entries[run],
+               (msec[run] > 0) ? (double)entries[run] / msec[run] : 0.);
+    }
+    printf("╚═══════════════════════════════════════╝\n");
+    return EXIT_SUCCESS;
+}
+
+int
+create_ents_arr(const char  *path,
+                ls_mode_t   *mode,
+                ls_dir_t    *dir)
+{
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    struct statx dir_stx;
+    bool use_cache = (mode->cache_dir != NULL) &&
+                     (statx(dir_fd, "", AT_EMPTY_PATH,
+                            STATX_INO | STATX_MTIME | STATX_CTIME, &dir_stx) == 0);
+    if (use_cache && cache_load(mode, &dir_stx, dir) == EXIT_SUCCESS)
+    {
+        close(dir_fd);
+        return EXIT_SUCCESS;
+    }
+
+    if (read_dir_entries(dir_fd, path, mode, dir) != EXIT_SUCCESS ||
+        stat_dir_entries(dir_fd, path, mode, dir) != EXIT_SUCCESS)
+    {
+        free_dir(dir);
+        close(dir_fd);
+        return EXIT_FAILURE;
+    }
+    close(dir_fd);
+
+    if (sort_dir(dir, mode) != EXIT_SUCCESS)
+    {
+        free_dir(dir);
+        return EXIT_FAILURE;
+    }
+    if (use_cache)
+    {
+        // A failed store only costs the next run a full listing
+        cache_store(mode, &dir_stx, dir);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Fills dir->sorted, in directory order with -U. "." and ".." always come
+// first, the rest is ordered by name ignoring a leading dot, then by the
+// -t / -S key if any.
+int
+sort_dir(ls_dir_t  *dir,
+         ls_mode_t *mode)
+{
+    // Two spare slots in front, the specials are moved there at the end
+    free(dir->sorted);
+    dir->sorted = (ls_sort_ent_t *)malloc((dir->size + 2) * sizeof(*dir->sorted));
+    if (dir->sorted == NULL)
+    {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    if (mode->flag_unsorted)
+    {
+        for (size_t i = 0; i != dir->size; ++i)
+        {
+            dir->sorted[i] = (ls_sort_ent_t){ .key = dir->names[i], .index = (uint32_t)i };
+        }
+        return EXIT_SUCCESS;
+    }
+
+    size_t special[2] = { SIZE_MAX, SIZE_MAX };
+    size_t size = 0;
+    ls_sort_ent_t *ents = dir->sorted + 2;
+    for (size_t i = 0; i != dir->size; ++i)
+    {
+        const char *name = dir->names[i];
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        {
+            special[name[1] == '.'] = i;
+            continue;
+        }
+        // Newest and largest first
+        uint64_t num = 0;
+        if (mode->sort_by == SORT_TIME)
+        {
+            const ls_stat_t *st = &dir->stats[i];
+            num = ~(((uint64_t)st->mtime * 1000000000u + (uint64_t)st->mtime_nsec) ^ (1ull << 63));
+        } else if (mode->sort_by == SORT_SIZE)
+        {
+            num = ~(uint64_t)dir->stats[i].size;
+        }
+        ents[size++] = (ls_sort_ent_t){
+            .key   = name + (name[0] == '.'),
+            .num   = num,
+            .index = (uint32_t)i,
+        };
+    }
+
+    if (mode->sort_by == SORT_VERSION)
+    {
+        qsort(ents, size, sizeof(*ents), compare_version);
+    } else
+    {
+        sort_keys(ents, size, 0);
+    }
+    if ((mode->sort_by == SORT_TIME || mode->sort_by == SORT_SIZE) &&
+        sort_nums(ents, size) != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+
+    // Put the specials in front of the sorted run
+    size_t nspecial = 0;
+    ls_sort_ent_t front[2];
+    for (size_t i = 0; i != 2; ++i)
+    {
+        if (special[i] != SIZE_MAX)
+        {
+            front[nspecial++] = (ls_sort_ent_t){
+                .key   = dir->names[special[i]],
+                .index = (uint32_t)special[i],
+            };
+        }
+    }
+    memmove(dir->sorted + nspecial, ents, size * sizeof(*ents));
+    memcpy(dir->sorted, front, nspecial * sizeof(*front));
+    return EXIT_SUCCESS;
+}
+
+bool
+needs_stats(ls_mode_t *mode)
+{
+    return mode->flag_long || mode->du_top != 0 ||
+           (!mode->flag_unsorted && (mode->sort_by == SORT_TIME || mode->sort_by == SORT_SIZE));
+}
+
+// Multikey quicksort: three-way partition on the character at depth, so
+// every character of a key is compared about once instead of in every
+// strcmp. Fully equal keys are ordered by index.
+void
+sort_keys(ls_sort_ent_t *ents,
+          size_t         size,
+          size_t         depth)
+{
+    while (size > kInsertionSortMax)
+    {
+        unsigned char a = (unsigned char)ents[0].key[depth];
+        unsigned char b = (unsigned char)ents[size / 2].key[depth];
+        unsigned char c = (unsigned char)ents[size - 1].key[depth];
+        unsigned char pivot = (a < b) ? ((b < c) ? b : (a < c) ? c : a)
+                                      : ((a < c) ? a : (b < c) ? c : b);
+
+        size_t lt = 0;
+        size_t gt = size;
+        for (size_t i = 0; i < gt; )
+        {
+            unsigned char ch = (unsigned char)ents[i].key[depth];
+            if (ch < pivot)
+            {
+                ls_sort_ent_t tmp = ents[lt]; ents[lt] = ents[i]; ents[i] = tmp;
+                lt++;
+                i++;
+            } else if (ch > pivot)
+            {
+                gt--;
+                ls_sort_ent_t tmp = ents[gt]; ents[gt] = ents[i]; ents[i] = tmp;
+            } else
+            {
+                i++;
+            }
+        }
+
+        sort_keys(ents,      lt,        depth);
+        sort_keys(ents + gt, size - gt, depth);
+        ents += lt;
+        size  = gt - lt;
+        if (pivot == '\0')
+        {
+            insertion_sort_keys(ents, size, depth);
+            return;
+        }
+        depth++;
+    }
+    insertion_sort_keys(ents, size, depth);
+}
+
+void
+insertion_sort_keys(ls_sort_ent_t *ents,
+                    size_t         size,
+                    size_t         depth)
+{
+    for (size_t i = 1; i < size; ++i)
+    {
+        ls_sort_ent_t cur = ents[i];
+        size_t j = i;
+        while (j != 0)
+        {
+            int result = strcmp(ents[j - 1].key + depth, cur.key + depth);
+            if (result < 0 || (result == 0 && ents[j - 1].index < cur.index))
+            {
+                break;
+            }
+            ents[j] = ents[j - 1];
+            j--;
+        }
+        ents[j] = cur;
+    }
+}
+
+// Stable LSD radix sort on num, a byte per pass. Passes where every key
+// has the same byte (high bytes of sizes and times) are skipped.
+int
+sort_nums(ls_sort_ent_t *ents,
+          size_t         size)
+{
+    size_t counts[8][256] = {};
+    for (size_t i = 0; i != size; ++i)
+    {
+        for (int byte = 0; byte != 8; ++byte)
+        {
+            counts[byte][(ents[i].num >> (8 * byte)) & 0xff]++;
+        }
+    }
+
+    ls_sort_ent_t *tmp = NULL;
+    ls_sort_ent_t *from = ents;
+    for (int byte = 0; byte != 8; ++byte)
+    {
+        size_t *count = counts[byte];
+        if (size == 0 || count[(ents[0].num >> (8 * byte)) & 0xff] == size)
+        {
+            continue;
+        }
+        if (tmp == NULL)
+        {
+            tmp = (ls_sort_ent_t *)malloc(size * sizeof(*tmp));
+            if (tmp == NULL)
+            {
+                perror("malloc");
+                return EXIT_FAILURE;
+            }
+        }
+        ls_sort_ent_t *to = (from == ents) ? tmp : ents;
+
+        size_t offset = 0;
+        for (int digit = 0; digit != 256; ++digit)
+        {
+            size_t n = count[digit];
+            count[digit] = offset;
+            offset += n;
+        }
+        for (size_t i = 0; i != size; ++i)
+        {
+            to[count[(from[i].num >> (8 * byte)) & 0xff]++] = from[i];
+        }
+        from = to;
+    }
+    if (from != ents)
+    {
+        memcpy(ents, from, size * sizeof(*ents));
+    }
+    free(tmp);
+    return EXIT_SUCCESS;
+}
+
+// Drops the entries but keeps the arrays for the next batch
+void
+clear_dir(ls_dir_t *dir)
+{
+    free(dir->sorted);
+    dir->sorted = NULL;
+    dir->size   = 0;
+    arena_free(&dir->arena);
+}
+
+void
+free_dir(ls_dir_t *dir)
+{
+    free(dir->names);
+    free(dir->types);
+    free(dir->inodes);
+    free(dir->stats);
+    free(dir->sorted);
+    arena_free(&dir->arena);
+    if (dir->mapping != NULL)
+    {
+        munmap(dir->mapping, dir->mapping_size);
+    }
+    *dir = (ls_dir_t){};
+}
+
+// Everything that changes what create_ents_arr() produces
+uint32_t
+cache_mode_key(ls_mode_t *mode)
+{
+    return (uint32_t)mode->flag_long             |
+           (uint32_t)mode->flag_recursive   << 1 |
+           (uint32_t)needs_stats(mode)      << 2 |
+           (uint32_t)(mode->du_top != 0)    << 3 |
+           (uint32_t)mode->flag_unsorted    << 4 |
+           (uint32_t)mode->sort_by          << 5;
+}
+
+int
+cache_file_path(ls_mode_t          *mode,
+                const struct statx *dir_stx,
+                char               *path,
+                size_t              size)
+{
+    int len = snprintf(path, size, "%s/%x-%x-%llx-%x",
+                       mode->cache_dir,
+                       dir_stx->stx_dev_major, dir_stx->stx_dev_minor,
+                       (unsigned long long)dir_stx->stx_ino,
+                       cache_mode_key(mode));
+    return (len > 0 && (size_t)len < size) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Maps the cache file of the directory if it is still current. Names are
+// used in place, the other fields are unpacked into the usual arrays.
+int
+cache_load(ls_mode_t          *mode,
+           const struct statx *dir_stx,
+           ls_dir_t           *dir)
+{
+    char path[PATH_MAX];
+    if (cache_file_path(mode, dir_stx, path, sizeof(path)) != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ls_cache_header_t))
+    {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    size_t size = (size_t)st.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return EXIT_FAILURE;
+    }
+
+    const ls_cache_header_t *header = (const ls_cache_header_t *)mapping;
+    const ls_cache_ent_t    *ents   = (const ls_cache_ent_t *)(header + 1);
+    const char              *names  = (const char *)(ents + header->count);
+    if (memcmp(header->magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+        header->mode_key   != cache_mode_key(mode) ||
+        header->dev        != makedev(dir_stx->stx_dev_major, dir_stx->stx_dev_minor) ||
+        header->ino        != dir_stx->stx_ino ||
+        header->mtime_sec  != dir_stx->stx_mtime.tv_sec ||
+        header->mtime_nsec != dir_stx->stx_mtime.tv_nsec ||
+        header->ctime_sec  != dir_stx->stx_ctime.tv_sec ||
+        header->ctime_nsec != dir_stx->stx_ctime.tv_nsec ||
+        header->count > (size - sizeof(*header)) / sizeof(*ents) ||
+        header->names_size == 0 ||
+        header->names_size != size - sizeof(*header) - header->count * sizeof(*ents) ||
+        names[header->names_size - 1] != '\0')
+    {
+        munmap(mapping, size);
+        return EXIT_FAILURE;
+    }
+
+    size_t count = header->count;
+    dir->mapping      = mapping;
+    dir->mapping_size = size;
+    dir->names  = (const char **)malloc((count + 1) * sizeof(*dir->names));
+    dir->types  = (uint8_t     *)malloc((count + 1) * sizeof(*dir->types));
+    dir->inodes = (ino_t       *)malloc((count + 1) * sizeof(*dir->inodes));
+    dir->sorted = (ls_sort_ent_t *)malloc((count + 1) * sizeof(*dir->sorted));
+    if (needs_stats(mode))
+    {
+        dir->stats = (ls_stat_t *)malloc((count + 1) * sizeof(*dir->stats));
+    }
+    if (dir->names == NULL || dir->types == NULL || dir->inodes == NULL || dir->sorted == NULL ||
+        (needs_stats(mode) && dir->stats == NULL))
+    {
+        perror("malloc");
+        free_dir(dir);
+        return EXIT_FAILURE;
+    }
+    dir->capacity = count + 1;
+
+    for (size_t i = 0; i != count; ++i)
+    {
+        const ls_cache_ent_t *ent = &ents[i];
+        if (ent->name_offset >= header->names_size)
+        {
+            free_dir(dir);
+            return EXIT_FAILURE;
+        }
+        dir->names [i] = names + ent->name_offset;
+        dir->types [i] = ent->type;
+        dir->inodes[i] = (ino_t)ent->ino;
+        dir->sorted[i] = (ls_sort_ent_t){ .key = dir->names[i], .index = (uint32_t)i };
+        if (dir->stats != NULL)
+        {
+            ls_stat_t *info  = &dir->stats[i];
+            info->mode       = ent->mode;
+            info->nlink      = ent->nlink;
+            info->uid        = ent->uid;
+            info->gid        = ent->gid;
+            info->size       = ent->size;
+            info->mtime      = ent->mtime;
+            info->mtime_nsec = ent->mtime_nsec;
+            info->blocks     = ent->blocks;
+            info->dev        = ent->dev;
+            info->user_name  = NULL;
+            info->group_name = NULL;
+            if (mode->flag_long)
+            {
+                info->user_name  = get_user_name(ent->uid, mode->flag_numeric);
+                info->group_name = get_group_name(ent->gid, mode->flag_numeric);
+                if (info->user_name == NULL || info->group_name == NULL)
+                {
+                    free_dir(dir);
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+    dir->size = count;
+    return EXIT_SUCCESS;
+}
+
+// Writes the sorted listing to a temporary file and renames it over the
+// cache file, so readers never see a partial one
+int
+cache_store(ls_mode_t          *mode,
+            const struct statx *dir_stx,
+            ls_dir_t           *dir)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec - dir_stx->stx_mtime.tv_sec < kCacheRacySeconds ||
+        now.tv_sec - dir_stx->stx_ctime.tv_sec < kCacheRacySeconds)
+    {
+        return EXIT_FAILURE;
+    }
+
+    size_t names_size = 0;
+    for (size_t i = 0; i != dir->size; ++i)
+    {
+        names_size += strlen(dir->names[i]) + 1;
+    }
+    if (names_size == 0 || names_size > UINT32_MAX)
+    {
+        return EXIT_FAILURE;
+    }
+
+    size_t size = sizeof(ls_cache_header_t) + dir->size * sizeof(ls_cache_ent_t) + names_size;
+    char *buffer = (char *)calloc(1, size);
+    if (buffer == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    ls_cache_header_t *header = (ls_cache_header_t *)buffer;
+    ls_cache_ent_t    *ents   = (ls_cache_ent_t *)(header + 1);
+    char              *names  = (char *)(ents + dir->size);
+    memcpy(header->magic, kCacheMagic, sizeof(kCacheMagic));
+    header->mode_key   = cache_mode_key(mode);
+    header->dev        = makedev(dir_stx->stx_dev_major, dir_stx->stx_dev_minor);
+    header->ino        = dir_stx->stx_ino;
+    header->mtime_sec  = dir_stx->stx_mtime.tv_sec;
+    header->mtime_nsec = dir_stx->stx_mtime.tv_nsec;
+    header->ctime_sec  = dir_stx->stx_ctime.tv_sec;
+    header->ctime_nsec = dir_stx->stx_ctime.tv_nsec;
+    header->count      = dir->size;
+    header->names_size = names_size;
 
-        size_t sym_uname = strlen(ents[i].user_name);
+    size_t offset = 0;
+    for (size_t ent = 0; ent != dir->size; ++ent)
+    {
+        uint32_t        index = dir->sorted[ent].index;
+        ls_cache_ent_t *out   = &ents[ent];
+        size_t          len   = strlen(dir->names[index]) + 1;
+        memcpy(names + offset, dir->names[index], len);
+        out->name_offset = (uint32_t)offset;
+        out->type        = dir->types[index];
+        out->ino         = dir->inodes[index];
+        offset += len;
+        if (dir->stats != NULL)
+        {
+            const ls_stat_t *st = &dir->stats[index];
+            out->mode       = st->mode;
+            out->nlink      = (uint32_t)st->nlink;
+            out->uid        = st->uid;
+            out->gid        = st->gid;
+            out->size       = st->size;
+            out->mtime      = st->mtime;
+            out->mtime_nsec = st->mtime_nsec;
+            out->blocks     = st->blocks;
+            out->dev        = st->dev;
+        }
+    }
 
-        size_t sym_gname = strlen(ents[i].group_name);
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    if (cache_file_path(mode, dir_stx, path, sizeof(path)) != EXIT_SUCCESS)
+    {
+        free(buffer);
+        return EXIT_FAILURE;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, gettid());
+    mkdir(mode->cache_dir, 0700);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        free(buffer);
+        return EXIT_FAILURE;
+    }
+    size_t done = 0;
+    while (done != size)
+    {
+        ssize_t written = write(fd, buffer + done, size - done);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        } else if (written <= 0)
+        {
+            break;
+        }
+        done += (size_t)written;
+    }
+    free(buffer);
+    if (close(fd) != 0 || done != size || rename(tmp_path, path) != 0)
+    {
+        unlink(tmp_path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
 
-        size_t sym_size = 0;
-        off_t st_size = ents[i].st.st_size;
-        do
+int
+get_limits(ls_dir_t   *dir,
+           ls_limit_t *limits,
+           ls_mode_t  *mode)
+{
+    if (mode->flag_inode && mode->flag_unsorted)
+    {
+        limits->max_sym_inode = kStreamSymInode;
+    } else if (mode->flag_inode)
+    {
+        for (size_t i = 0; i != dir->size; ++i)
+        {
+            if (dir->names[i][0] == '.' && !mode->flag_all && !dir->operands)
+            {
+                continue;
+            }
+            size_t sym_inode = count_digits(dir->inodes[i]);
+            if (sym_inode > limits->max_sym_inode) limits->max_sym_inode = sym_inode;
+        }
+    }
+    if (!mode->flag_long)
+    {
+        return EXIT_SUCCESS;
+    }
+    if (mode->flag_unsorted)
+    {
+        limits->max_sym_nlink = kStreamSymNlink;
+        limits->max_sym_uname = kStreamSymName;
+        limits->max_sym_gname = kStreamSymName;
+        limits->max_sym_size  = kStreamSymSize;
+        limits->max_sym_day   = kStreamSymDay;
+        return EXIT_SUCCESS;
+    }
+    for (size_t i = 0; i != dir->size; ++i)
+    {
+        if (dir->names[i][0] == '.' && !mode->flag_all && !dir->operands)
         {
-            sym_size++;
-            st_size /= 10;
-        } while (st_size != 0);
+            continue;
+        }
+        const ls_stat_t *st = &dir->stats[i];
 
-        time_t mtime_val = ents[i].st.st_mtime;
-        struct tm *timeinfo = localtime(&mtime_val);
-        char buffer[100];
-        strftime(buffer, sizeof(buffer), "%d", timeinfo);
-        size_t sym_day = strlen(buffer);
+        size_t sym_nlink = count_digits(st->nlink);
+        size_t sym_uname = strlen(st->user_name);
+        size_t sym_gname = strlen(st->group_name);
+        size_t sym_size  = count_digits((uint64_t)st->size);
+        size_t sym_day   = kSymDay;
 
         if (sym_nlink > limits->max_sym_nlink) limits->max_sym_nlink = sym_nlink;
         if (sym_uname > limits->max_sym_uname) limits->max_sym_uname = sym_uname;
@@ -388,3 +3413,179 @@ get_limits(ent_info_t *ents,
     }
     return EXIT_SUCCESS;
 }
+
+void *
+arena_alloc(ls_arena_t *arena,
+            size_t      size)
+{
+    size = (size + 7) & ~(size_t)7;
+    ls_arena_chunk_t *top = arena->top;
+    if (top == NULL || top->size - top->used < size)
+    {
+        size_t chunk_size = (size > kArenaChunkSize) ? size : kArenaChunkSize;
+        ls_arena_chunk_t *chunk = (ls_arena_chunk_t *)malloc(sizeof(*chunk) + chunk_size);
+        if (chunk == NULL)
+        {
+            perror("malloc");
+            return NULL;
+        }
+        chunk->prev = top;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        arena->top  = top = chunk;
+    }
+    void *ptr = top->data + top->used;
+    top->used += size;
+    return ptr;
+}
+
+char *
+arena_strndup(ls_arena_t *arena,
+              const char *str,
+              size_t      len)
+{
+    char *copy = (char *)arena_alloc(arena, len + 1);
+    if (copy != NULL)
+    {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+void
+arena_free(ls_arena_t *arena)
+{
+    while (arena->top != NULL)
+    {
+        ls_arena_chunk_t *prev = arena->top->prev;
+        free(arena->top);
+        arena->top = prev;
+    }
+}
+
+static size_t
+id_hash(uint32_t id)
+{
+    // Fibonacci hashing, ids are often small and sequential
+    return (size_t)((id * 2654435769u) >> 7);
+}
+
+ls_id_name_t *
+id_cache_slot(ls_id_cache_t *cache,
+              uint32_t       id)
+{
+    size_t mask = cache->capacity - 1;
+    for (size_t i = id_hash(id) & mask; ; i = (i + 1) & mask)
+    {
+        if (cache->slots[i].name == NULL || cache->slots[i].id == id)
+        {
+            return &cache->slots[i];
+        }
+    }
+}
+
+int
+id_cache_grow(ls_id_cache_t *cache)
+{
+    size_t        old_capacity = cache->capacity;
+    ls_id_name_t *old_slots    = cache->slots;
+
+    cache->capacity = (old_capacity != 0) ? 2 * old_capacity : kIdCacheStart;
+    cache->slots    = (ls_id_name_t *)calloc(cache->capacity, sizeof(*cache->slots));
+    if (cache->slots == NULL)
+    {
+        perror("calloc");
+        cache->slots    = old_slots;
+        cache->capacity = old_capacity;
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i != old_capacity; ++i)
+    {
+        if (old_slots[i].name != NULL)
+        {
+            *id_cache_slot(cache, old_slots[i].id) = old_slots[i];
+        }
+    }
+    free(old_slots);
+    return EXIT_SUCCESS;
+}
+
+// Returns cached name for id, calling lookup only on the first request.
+// Ids without a name are shown as numbers, like coreutils ls does.
+const char *
+id_cache_get(ls_id_cache_t *cache,
+             uint32_t       id,
+             int            kind)
+{
+    if (2 * (cache->size + 1) > cache->capacity && id_cache_grow(cache) != EXIT_SUCCESS)
+    {
+        return NULL;
+    }
+    ls_id_name_t *slot = id_cache_slot(cache, id);
+    if (slot->name != NULL)
+    {
+        return slot->name;
+    }
+
+    const char *name = NULL;
+    if (kind == ID_USER)
+    {
+        struct passwd *pw = getpwuid(id);
+        name = (pw != NULL) ? pw->pw_name : NULL;
+    } else if (kind == ID_GROUP)
+    {
+        struct group *gr = getgrgid(id);
+        name = (gr != NULL) ? gr->gr_name : NULL;
+    }
+    char number[16] = {};
+    if (name == NULL)
+    {
+        snprintf(number, sizeof(number), "%u", id);
+        name = number;
+    }
+
+    slot->id   = id;
+    slot->name = arena_strndup(&names_arena, name, strlen(name));
+    if (slot->name == NULL)
+    {
+        return NULL;
+    }
+    cache->size++;
+    return slot->name;
+}
+
+const char *
+get_user_name(uid_t uid,
+              bool  numeric)
+{
+    // Stat'ing happens in the -R workers
+    pthread_mutex_lock(&names_lock);
+    const char *name = numeric ? id_cache_get(&number_cache, uid, ID_NUMBER)
+                               : id_cache_get(&user_cache,   uid, ID_USER);
+    pthread_mutex_unlock(&names_lock);
+    return name;
+}
+
+const char *
+get_group_name(gid_t gid,
+               bool  numeric)
+{
+    pthread_mutex_lock(&names_lock);
+    const char *name = numeric ? id_cache_get(&number_cache, gid, ID_NUMBER)
+                               : id_cache_get(&group_cache,  gid, ID_GROUP);
+    pthread_mutex_unlock(&names_lock);
+    return name;
+}
+
+void
+free_name_caches(void)
+{
+    free(user_cache.slots);
+    free(group_cache.slots);
+    free(number_cache.slots);
+    user_cache   = (ls_id_cache_t){};
+    group_cache  = (ls_id_cache_t){};
+    number_cache = (ls_id_cache_t){};
+    arena_free(&names_arena);
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Checks that ls --du counts dot-directories like du does.
+# Run from the repository root after `make PROJECT=ls`.
+
+LS=${LS:-./ls/ls}
+TREE=$(mktemp -d)
+trap 'rm -rf "$TREE"' EXIT
+
+mkdir -p "$TREE/visible" "$TREE/.hidden/deep" "$TREE/visible/.cache"
+head -c 100000 /dev/zero > "$TREE/.hidden/deep/big"
+head -c 50000  /dev/zero > "$TREE/visible/.cache/blob"
+echo data > "$TREE/visible/file"
+
+status=0
+expected=$(du -sk "$TREE" | cut -f1)
+for flags in "" "-a" "-j4" "-a -j4"; do
+    got=$($LS $flags --du=1 "$TREE" | tail -n 1 | cut -f1)
+    if [ "$got" != "$expected" ]; then
+        echo "FAIL: ls $flags --du reports $got KiB, du -sk reports $expected KiB"
+        status=1
+    fi
+done
+
+# The hidden subtree is reported on its own as well
+if ! $LS --du=5 "$TREE" | grep -q "/.hidden$"; then
+    echo "FAIL: .hidden is missing from the --du summary"
+    status=1
+fi
+
+[ $status -eq 0 ] && echo "ok"
+exit $status
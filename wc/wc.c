@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -5,30 +6,410 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define BUFFER_SIZE (4)
+#define BUFFER_SIZE (1 << 16)
+// Bucket 0 holds empty lines, bucket k lengths in [2^(k-1), 2^k)
+#define HIST_BUCKETS (65)
+#define ARENA_CHUNK  (1 << 20)
 
 typedef struct
 {
-    size_t bytes;
-    size_t words;
-    size_t lines;
+    bool flag_chars; // -m: count UTF-8 characters, split words on Unicode spaces
+    bool flag_json;  // -j: print the report as a single JSON object
+    bool flag_max;   // -L: print the longest line length
+    bool flag_hist;  // -H: print log2 histogram of line lengths
+    int  count_byte; // -b: byte value to count, -1 if not requested
+    bool flag_files; // -f: operands are files to count, not a command
+    const char *files0_from; // --files0-from: NUL-separated file list, "-" is stdin
+    long threads;    // -t: worker threads in file mode, 0 means all CPUs
+} mywc_mode_t;
+
+typedef struct
+{
+    size_t   bytes;
+    size_t   words;
+    size_t   lines;
+    size_t   chars;
+    size_t   invalid;  // malformed UTF-8 sequences (-m only)
+    bool     in_word;
+    // Line lengths, in bytes (or characters with -m) without the newline
+    size_t   cur_line;
+    size_t   max_line;
+    size_t   line_hist[HIST_BUCKETS];
+    size_t   byte_count;
+    // UTF-8 decoder state, sequences can be split between reads
+    uint32_t cp;       // code point accumulated so far
+    uint8_t  need;     // continuation bytes still expected
+    uint8_t  lo;       // allowed range for the next continuation byte,
+    uint8_t  hi;       // narrower than 80..BF after E0, ED, F0 and F4
 } mywc_info_t;
 
+// Resources used by the wrapped command
+typedef struct
+{
+    double        wall_ms;
+    int           status;
+    struct rusage usage;
+} mywc_prof_t;
+
+// Bump allocator, everything is released at once by arena_free()
+typedef struct mywc_arena_chunk_t
+{
+    struct mywc_arena_chunk_t *prev;
+    size_t                     used;
+    size_t                     size;
+    char                       data[];
+} mywc_arena_chunk_t;
+
+typedef struct
+{
+    mywc_arena_chunk_t *top;
+} mywc_arena_t;
+
+// Counters of one file in file mode, the histogram goes to worker totals
+typedef struct
+{
+    size_t      bytes;
+    size_t      words;
+    size_t      lines;
+    size_t      chars;
+    size_t      invalid;
+    size_t      max_line;
+    size_t      byte_count;
+    int         error;   // errno of failed open/read, 0 on success
+    atomic_bool done;
+} mywc_file_result_t;
+
+typedef struct
+{
+    const mywc_mode_t   *mode;
+    char* const         *names;
+    mywc_file_result_t  *results;
+    size_t               count;
+    atomic_size_t        next;  // first file not taken by any worker
+    pthread_mutex_t      lock;  // guards cond, printer waits on it
+    pthread_cond_t       cond;
+} mywc_pool_t;
+
+typedef struct
+{
+    mywc_pool_t *pool;
+    pthread_t    thread;
+    size_t       line_hist[HIST_BUCKETS];
+} mywc_worker_t;
+
+int get_flags(int argc, char* const* argv, mywc_mode_t *mode);
+int count_files(const mywc_mode_t *mode, size_t count, char* const* names);
+int count_files0_from(const mywc_mode_t *mode);
+void print_hist(const size_t *line_hist);
+void print_hist_json(const size_t *line_hist);
+void print_report(const mywc_mode_t *mode, const mywc_info_t *info, const mywc_prof_t *prof);
+void print_report_json(const mywc_mode_t *mode, const mywc_info_t *info, const mywc_prof_t *prof);
+
+static inline void
+finish_line(mywc_info_t *info)
+{
+    size_t len = info->cur_line;
+    if (len > info->max_line)
+    {
+        info->max_line = len;
+    }
+    info->line_hist[len ? 64 - __builtin_clzl(len) : 0]++;
+    info->cur_line = 0;
+}
+
+void
+count_info(const mywc_mode_t *mode,
+           const char        *buffer,
+           size_t             readsz,
+           mywc_info_t       *info)
+{
+    info->bytes += readsz;
+    for (size_t i = 0; i < readsz; ++i)
+    {
+        if (buffer[i] == '\n')
+        {
+            info->lines++;
+            finish_line(info);
+        } else
+        {
+            info->cur_line++;
+        }
+        if ((unsigned char)buffer[i] == mode->count_byte)
+        {
+            info->byte_count++;
+        }
+        if (!isspace((unsigned char)buffer[i]))
+        {
+            if (!info->in_word)
+            {
+                info->words++;
+                info->in_word = true;
+            }
+        } else
+        {
+            info->in_word = false;
+        }
+    }
+}
+
+static inline void
+count_word(mywc_info_t *info,
+           bool         is_space)
+{
+    if (is_space)
+    {
+        info->in_word = false;
+    } else if (!info->in_word)
+    {
+        info->words++;
+        info->in_word = true;
+    }
+}
+
+// White_Space code points except the no-break ones (same set as iswspace)
+static inline bool
+is_unicode_space(uint32_t cp)
+{
+    if (cp < 0x80)
+    {
+        return cp == ' ' || (cp >= '\t' && cp <= '\r');
+    }
+    return cp == 0x0085 || cp == 0x1680 ||
+           (cp >= 0x2000 && cp <= 0x200A && cp != 0x2007) ||
+           cp == 0x2028 || cp == 0x2029 || cp == 0x205F || cp == 0x3000;
+}
+
+// Scalar UTF-8 DFA: validates, counts characters and words for [begin, end)
+static void
+count_utf8_scalar(const mywc_mode_t   *mode,
+                  const unsigned char *buffer,
+                  size_t               begin,
+                  size_t               end,
+                  mywc_info_t         *info)
+{
+    for (size_t i = begin; i < end; ++i)
+    {
+        unsigned char c = buffer[i];
+        if (c == mode->count_byte)
+        {
+            info->byte_count++;
+        }
+        if (info->need != 0)
+        {
+            if (c >= info->lo && c <= info->hi)
+            {
+                info->cp = (info->cp << 6) | (c & 0x3F);
+                info->lo = 0x80;
+                info->hi = 0xBF;
+                if (--info->need == 0)
+                {
+                    info->chars++;
+                    info->cur_line++;
+                    count_word(info, is_unicode_space(info->cp));
+                }
+                continue;
+            }
+            // Truncated sequence, c is reprocessed as a lead byte
+            info->need = 0;
+            info->invalid++;
+            info->cur_line++;
+            count_word(info, false);
+        }
+
+        if (c < 0x80)
+        {
+            info->chars++;
+            if (c == '\n')
+            {
+                info->lines++;
+                finish_line(info);
+            } else
+            {
+                info->cur_line++;
+            }
+            count_word(info, is_unicode_space(c));
+        } else if (c >= 0xC2 && c <= 0xDF)
+        {
+            info->need = 1;
+            info->cp   = c & 0x1F;
+            info->lo   = 0x80;
+            info->hi   = 0xBF;
+        } else if (c >= 0xE0 && c <= 0xEF)
+        {
+            info->need = 2;
+            info->cp   = c & 0x0F;
+            info->lo   = (c == 0xE0) ? 0xA0 : 0x80; // overlong
+            info->hi   = (c == 0xED) ? 0x9F : 0xBF; // surrogates
+        } else if (c >= 0xF0 && c <= 0xF4)
+        {
+            info->need = 3;
+            info->cp   = c & 0x07;
+            info->lo   = (c == 0xF0) ? 0x90 : 0x80; // overlong
+            info->hi   = (c == 0xF4) ? 0x8F : 0xBF; // above U+10FFFF
+        } else
+        {
+            // Stray continuation byte or C0, C1, F5..FF
+            info->invalid++;
+            info->cur_line++;
+            count_word(info, false);
+        }
+    }
+}
+
+// Counting for -m. Blocks of 16 ASCII bytes (the common case even in
+// multilingual logs) are counted with SSE2 masks: every byte is a valid
+// character, so validation is the single sign-bit test. Blocks with any
+// non-ASCII byte go through the scalar DFA, which then keeps the
+// decoder state for the next block.
+void
+count_info_utf8(const mywc_mode_t *mode,
+                const char        *buffer,
+                size_t             readsz,
+                mywc_info_t       *info)
+{
+    const unsigned char *buf = (const unsigned char *)buffer;
+    info->bytes += readsz;
+
+    size_t i = 0;
+    while (i < readsz)
+    {
+#ifdef __SSE2__
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i space   = _mm_set1_epi8(' ');
+        const __m128i tab_lo  = _mm_set1_epi8('\t' - 1);
+        const __m128i cr_hi   = _mm_set1_epi8('\r' + 1);
+        const __m128i target  = _mm_set1_epi8((char)mode->count_byte);
+        while (info->need == 0 && i + 16 <= readsz)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+            if (_mm_movemask_epi8(v) != 0)
+            {
+                break;
+            }
+            unsigned nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+            __m128i  ws = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                       _mm_and_si128(_mm_cmpgt_epi8(v, tab_lo),
+                                                     _mm_cmplt_epi8(v, cr_hi)));
+            unsigned sp = _mm_movemask_epi8(ws);
+            // Word starts where a non-space follows a space
+            unsigned prev_sp = (sp << 1) | (info->in_word ? 0 : 1);
+            unsigned starts  = ~sp & prev_sp & 0xFFFF;
+
+            info->lines  += __builtin_popcount(nl);
+            info->words  += __builtin_popcount(starts);
+            info->chars  += 16;
+            info->in_word = !(sp & 0x8000);
+            if (mode->count_byte >= 0)
+            {
+                info->byte_count += __builtin_popcount(
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(v, target)));
+            }
+
+            // Every set bit of nl ends a line
+            unsigned last = 0;
+            while (nl != 0)
+            {
+                unsigned pos = __builtin_ctz(nl);
+                info->cur_line += pos - last;
+                finish_line(info);
+                last = pos + 1;
+                nl &= nl - 1;
+            }
+            info->cur_line += 16 - last;
+            i += 16;
+        }
+#endif
+        size_t end = (i + 16 < readsz) ? i + 16 : readsz;
+        count_utf8_scalar(mode, buf, i, end, info);
+        i = end;
+    }
+}
+
+// Accounts for a sequence or a line cut by the end of input
+void
+count_info_finish(mywc_info_t *info)
+{
+    if (info->need != 0)
+    {
+        info->need = 0;
+        info->invalid++;
+        info->cur_line++;
+    }
+    if (info->cur_line != 0)
+    {
+        finish_line(info);
+    }
+}
+
+static inline void
+count_chunk(const mywc_mode_t *mode,
+            const char        *buffer,
+            size_t             readsz,
+            mywc_info_t       *info)
+{
+    if (mode->flag_chars)
+    {
+        count_info_utf8(mode, buffer, readsz, info);
+    } else
+    {
+        count_info(mode, buffer, readsz, info);
+    }
+}
+
 int
-copy_file(int          fd_from,
-          int          fd_to,
-          mywc_info_t *info)
+write_all(int         fd_to,
+          const char *buffer,
+          size_t      size)
 {
-    bool in_word = false;
-    char buffer[BUFFER_SIZE];
+    size_t written = 0;
+    while (written < size)
+    {
+        ssize_t write_bytes = write(fd_to, buffer + written, size - written);
+        if (write_bytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Writing error");
+            return EXIT_FAILURE;
+        }
+        written += write_bytes;
+    }
+    return EXIT_SUCCESS;
+}
+
+int
+copy_file(const mywc_mode_t *mode,
+          int                fd_from,
+          int                fd_to,
+          mywc_info_t       *info)
+{
+    static char buffer[BUFFER_SIZE];
     while (true)
     {
         ssize_t read_bytes = read(fd_from, buffer, BUFFER_SIZE);
         if (read_bytes < 0)
         {
+            if (errno == EINTR)
+            {
+                continue;
+            }
             perror("Reading error");
             return EXIT_FAILURE;
         } else if (read_bytes == 0)
@@ -36,51 +417,506 @@ copy_file(int          fd_from,
             break;
         }
 
-        info->bytes += read_bytes;
-        for (ssize_t i = 0; i < read_bytes; ++i)
+        count_chunk(mode, buffer, read_bytes, info);
+
+        if (write_all(fd_to, buffer, read_bytes) != EXIT_SUCCESS)
         {
-            if (buffer[i] == '\n')
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// Zero-copy variant of copy_file() for the case when both ends are pipes:
+// tee() duplicates pipe pages into fd_to inside the kernel, then the same
+// bytes are consumed from fd_from into userspace only to be counted.
+// Returns -1 if tee() is not supported here, so caller can fall back.
+int
+copy_file_tee(const mywc_mode_t *mode,
+              int                fd_from,
+              int                fd_to,
+              mywc_info_t       *info)
+{
+    static char buffer[BUFFER_SIZE];
+    while (true)
+    {
+        ssize_t teed = tee(fd_from, fd_to, INT_MAX, 0);
+        if (teed < 0)
+        {
+            if (errno == EINTR)
             {
-                info->lines++;
+                continue;
+            }
+            if ((errno == EINVAL || errno == ENOSYS) && info->bytes == 0)
+            {
+                return -1;
             }
-            if (!isspace(buffer[i]))
+            perror("tee");
+            return EXIT_FAILURE;
+        } else if (teed == 0)
+        {
+            break;
+        }
+
+        // Consuming exactly what was duplicated
+        while (teed > 0)
+        {
+            size_t  chunk      = (teed < BUFFER_SIZE) ? (size_t)teed : BUFFER_SIZE;
+            ssize_t read_bytes = read(fd_from, buffer, chunk);
+            if (read_bytes < 0)
             {
-                if (!in_word)
+                if (errno == EINTR)
                 {
-                    info->words++;
-                    in_word = true;
+                    continue;
                 }
+                perror("Reading error");
+                return EXIT_FAILURE;
+            }
+            count_chunk(mode, buffer, read_bytes, info);
+            teed -= read_bytes;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int
+forward_output(const mywc_mode_t *mode,
+               int                fd_from,
+               int                fd_to,
+               mywc_info_t       *info)
+{
+    struct stat st;
+    if (fstat(fd_to, &st) == 0 && S_ISFIFO(st.st_mode))
+    {
+        // Bigger pipe means less tee() round trips, failure is harmless
+        fcntl(fd_from, F_SETPIPE_SZ, 1 << 20);
+
+        int result = copy_file_tee(mode, fd_from, fd_to, info);
+        if (result != -1)
+        {
+            return result;
+        }
+    }
+    return copy_file(mode, fd_from, fd_to, info);
+}
+
+void *
+arena_alloc(mywc_arena_t *arena,
+            size_t        size)
+{
+    size = (size + 15) & ~(size_t)15;
+    mywc_arena_chunk_t *top = arena->top;
+    if (top == NULL || top->size - top->used < size)
+    {
+        size_t chunk_size = (size > ARENA_CHUNK) ? size : ARENA_CHUNK;
+        mywc_arena_chunk_t *chunk = (mywc_arena_chunk_t *)malloc(sizeof(*chunk) + chunk_size);
+        if (chunk == NULL)
+        {
+            perror("malloc");
+            return NULL;
+        }
+        chunk->prev = top;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        arena->top  = top = chunk;
+    }
+    void *ptr = top->data + top->used;
+    top->used += size;
+    return ptr;
+}
+
+void
+arena_free(mywc_arena_t *arena)
+{
+    while (arena->top != NULL)
+    {
+        mywc_arena_chunk_t *prev = arena->top->prev;
+        free(arena->top);
+        arena->top = prev;
+    }
+}
+
+// Counts one whole file, buffer is owned by the calling thread
+int
+count_fd(const mywc_mode_t *mode,
+         int                fd,
+         char              *buffer,
+         mywc_info_t       *info)
+{
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (true)
+    {
+        ssize_t read_bytes = read(fd, buffer, BUFFER_SIZE);
+        if (read_bytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno;
+        } else if (read_bytes == 0)
+        {
+            break;
+        }
+        count_chunk(mode, buffer, read_bytes, info);
+    }
+    count_info_finish(info);
+    return 0;
+}
+
+void *
+count_worker(void *arg)
+{
+    mywc_worker_t *worker = (mywc_worker_t *)arg;
+    mywc_pool_t   *pool   = worker->pool;
+
+    char *buffer = (char *)malloc(BUFFER_SIZE);
+    while (true)
+    {
+        size_t index = atomic_fetch_add(&pool->next, 1);
+        if (index >= pool->count)
+        {
+            break;
+        }
+
+        mywc_file_result_t *result = &pool->results[index];
+        const char         *name   = pool->names[index];
+        mywc_info_t         info   = {0};
+
+        if (buffer == NULL)
+        {
+            result->error = ENOMEM;
+        } else if (strcmp(name, "-") == 0)
+        {
+            result->error = count_fd(pool->mode, STDIN_FILENO, buffer, &info);
+        } else
+        {
+            int fd = open(name, O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                result->error = errno;
             } else
             {
-                in_word = false;
+                result->error = count_fd(pool->mode, fd, buffer, &info);
+                close(fd);
             }
         }
 
-        // TODO determine words
+        result->bytes      = info.bytes;
+        result->words      = info.words;
+        result->lines      = info.lines;
+        result->chars      = info.chars;
+        result->invalid    = info.invalid;
+        result->max_line   = info.max_line;
+        result->byte_count = info.byte_count;
+        for (int k = 0; k != HIST_BUCKETS; ++k)
+        {
+            worker->line_hist[k] += info.line_hist[k];
+        }
 
-        ssize_t written = 0;
-        while (written < read_bytes)
+        atomic_store_explicit(&result->done, true, memory_order_release);
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    free(buffer);
+    return NULL;
+}
+
+void
+print_json_string(const char *str)
+{
+    putchar('"');
+    for (const unsigned char *c = (const unsigned char *)str; *c != '\0'; ++c)
+    {
+        if (*c == '"' || *c == '\\')
         {
-            ssize_t write_bytes = write(fd_to, buffer + written, read_bytes - written);
-            if (write_bytes < 0)
+            printf("\\%c", *c);
+        } else if (*c < 0x20)
+        {
+            printf("\\u%04x", *c);
+        } else
+        {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+void
+print_file_result(const mywc_mode_t        *mode,
+                  const char               *name,
+                  const mywc_file_result_t *result)
+{
+    if (mode->flag_json)
+    {
+        printf("{\"file\": ");
+        if (name != NULL)
+        {
+            print_json_string(name);
+        } else
+        {
+            printf("null, \"total\": true");
+        }
+        printf(", \"bytes\": %lu, \"words\": %lu, \"lines\": %lu",
+               result->bytes, result->words, result->lines);
+        if (mode->flag_chars)
+        {
+            printf(", \"chars\": %lu, \"invalid_utf8\": %lu", result->chars, result->invalid);
+        }
+        if (mode->flag_max)
+        {
+            printf(", \"max_line_length\": %lu", result->max_line);
+        }
+        if (mode->count_byte >= 0)
+        {
+            printf(", \"byte\": %d, \"byte_count\": %lu", mode->count_byte, result->byte_count);
+        }
+        printf("}\n");
+        return;
+    }
+
+    // Same column order as coreutils wc
+    printf("%8lu %8lu", result->lines, result->words);
+    if (mode->flag_chars)
+    {
+        printf(" %8lu", result->chars);
+    }
+    printf(" %8lu", result->bytes);
+    if (mode->flag_max)
+    {
+        printf(" %8lu", result->max_line);
+    }
+    if (mode->count_byte >= 0)
+    {
+        printf(" %8lu", result->byte_count);
+    }
+    printf(" %s\n", (name != NULL) ? name : "total");
+}
+
+// File mode: workers take files in order from a shared counter, main
+// thread prints each result as soon as all previous ones are printed.
+int
+count_files(const mywc_mode_t *mode,
+            size_t             count,
+            char* const*       names)
+{
+    mywc_arena_t arena = {};
+    mywc_pool_t  pool  = {
+        .mode  = mode,
+        .names = names,
+        .count = count,
+        .lock  = PTHREAD_MUTEX_INITIALIZER,
+        .cond  = PTHREAD_COND_INITIALIZER,
+    };
+    atomic_init(&pool.next, 0);
+    pool.results = (mywc_file_result_t *)arena_alloc(&arena, count * sizeof(*pool.results));
+    if (pool.results == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    memset(pool.results, 0, count * sizeof(*pool.results));
+
+    long nthreads = mode->threads;
+    if (nthreads == 0)
+    {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads < 1)
+    {
+        nthreads = 1;
+    }
+    if ((size_t)nthreads > count)
+    {
+        nthreads = (count != 0) ? (long)count : 1;
+    }
+
+    mywc_worker_t *workers = (mywc_worker_t *)arena_alloc(&arena, nthreads * sizeof(*workers));
+    if (workers == NULL)
+    {
+        arena_free(&arena);
+        return EXIT_FAILURE;
+    }
+    long started = 0;
+    for (; started != nthreads; ++started)
+    {
+        memset(&workers[started], 0, sizeof(workers[started]));
+        workers[started].pool = &pool;
+        if (pthread_create(&workers[started].thread, NULL, count_worker, &workers[started]) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+    }
+    if (started == 0)
+    {
+        // Counting in this thread then
+        mywc_worker_t self = {.pool = &pool};
+        count_worker(&self);
+        workers[0] = self;
+        started = -1;
+    }
+
+    int status = EXIT_SUCCESS;
+    mywc_file_result_t total = {};
+    for (size_t i = 0; i != count; ++i)
+    {
+        mywc_file_result_t *result = &pool.results[i];
+        if (!atomic_load_explicit(&result->done, memory_order_acquire))
+        {
+            pthread_mutex_lock(&pool.lock);
+            while (!atomic_load_explicit(&result->done, memory_order_acquire))
             {
-                perror("Writing error");
-                return EXIT_FAILURE;
+                pthread_cond_wait(&pool.cond, &pool.lock);
             }
-            written += write_bytes;
+            pthread_mutex_unlock(&pool.lock);
+        }
+
+        if (result->error != 0)
+        {
+            fflush(stdout);
+            fprintf(stderr, "%s: %s\n", names[i], strerror(result->error));
+            status = EXIT_FAILURE;
+            continue;
+        }
+        print_file_result(mode, names[i], result);
+
+        total.bytes      += result->bytes;
+        total.words      += result->words;
+        total.lines      += result->lines;
+        total.chars      += result->chars;
+        total.invalid    += result->invalid;
+        total.byte_count += result->byte_count;
+        if (result->max_line > total.max_line)
+        {
+            total.max_line = result->max_line;
         }
     }
-    return EXIT_SUCCESS;
+
+    size_t line_hist[HIST_BUCKETS] = {};
+    for (long t = 0; t != ((started < 0) ? 1 : started); ++t)
+    {
+        if (started > 0)
+        {
+            pthread_join(workers[t].thread, NULL);
+        }
+        for (int k = 0; k != HIST_BUCKETS; ++k)
+        {
+            line_hist[k] += workers[t].line_hist[k];
+        }
+    }
+
+    if (count > 1)
+    {
+        print_file_result(mode, NULL, &total);
+    }
+    if (mode->flag_hist && mode->flag_json)
+    {
+        // Histogram is over all files, it gets a line of its own
+        printf("{");
+        print_hist_json(line_hist);
+        printf("}\n");
+    } else if (mode->flag_hist)
+    {
+        print_hist(line_hist);
+    }
+
+    arena_free(&arena);
+    return status;
+}
+
+int
+count_files0_from(const mywc_mode_t *mode)
+{
+    FILE *list = stdin;
+    if (strcmp(mode->files0_from, "-") != 0)
+    {
+        list = fopen(mode->files0_from, "r");
+        if (list == NULL)
+        {
+            perror(mode->files0_from);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Names go to the arena, only the pointer array is reallocated
+    mywc_arena_t arena    = {};
+    char       **names    = NULL;
+    size_t       count    = 0;
+    size_t       capacity = 0;
+    char        *line     = NULL;
+    size_t       line_cap = 0;
+    ssize_t      len      = 0;
+    int          status   = EXIT_SUCCESS;
+    while ((len = getdelim(&line, &line_cap, '\0', list)) > 0)
+    {
+        if (line[len - 1] == '\0')
+        {
+            len--;
+        }
+        if (len == 0)
+        {
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity = (capacity != 0) ? 2 * capacity : 1024;
+            char **new_names = (char **)realloc(names, capacity * sizeof(*names));
+            if (new_names == NULL)
+            {
+                perror("realloc");
+                status = EXIT_FAILURE;
+                break;
+            }
+            names = new_names;
+        }
+        char *name = (char *)arena_alloc(&arena, len + 1);
+        if (name == NULL)
+        {
+            status = EXIT_FAILURE;
+            break;
+        }
+        memcpy(name, line, len);
+        name[len] = '\0';
+        names[count++] = name;
+    }
+    free(line);
+    if (list != stdin)
+    {
+        fclose(list);
+    }
+
+    if (status == EXIT_SUCCESS)
+    {
+        status = count_files(mode, count, names);
+    }
+    free(names);
+    arena_free(&arena);
+    return status;
 }
 
 int
 main(int          argc,
      char* const* argv) {
-    if (argc < 2)
+    mywc_mode_t mode = {.count_byte = -1};
+    if (get_flags(argc, argv, &mode) != 0 ||
+        (optind >= argc && mode.files0_from == NULL))
     {
-        fprintf(stderr, "usage: %s [proc]", argv[0]);
+        fprintf(stderr, "usage: %s [-mjLH] [-b byte] [proc]\n"
+                        "       %s [-mjLH] [-b byte] [-t threads] -f file...\n"
+                        "       %s [-mjLH] [-b byte] [-t threads] --files0-from=list\n",
+                argv[0], argv[0], argv[0]);
         return EXIT_FAILURE;
     }
+    if (mode.files0_from != NULL)
+    {
+        return count_files0_from(&mode);
+    }
+    if (mode.flag_files)
+    {
+        return count_files(&mode, argc - optind, argv + optind);
+    }
+    char* const* cmd = argv + optind;
 
     int pipefds[2];
     if (pipe(pipefds) != 0)
@@ -90,9 +926,9 @@ main(int          argc,
     }
 
     // Start time
-    struct timeval start;
-    if (gettimeofday(&start, NULL) != 0) {
-        perror("gettimeofday");
+    struct timespec start;
+    if (clock_gettime(CLOCK_MONOTONIC, &start) != 0) {
+        perror("clock_gettime");
         return EXIT_FAILURE;
     }
 
@@ -105,9 +941,9 @@ main(int          argc,
         // Closing write fd
         close(pipefds[1]);
         // Runtting program in child proccess
-        execvp(argv[1], argv + 1);
+        execvp(cmd[0], cmd);
         // Failure if was here
-        perror(argv[1]);
+        perror(cmd[0]);
         return EXIT_FAILURE;
     }
     // Closing write fd for parent
@@ -115,33 +951,275 @@ main(int          argc,
 
     // Copying pipe to stdout and counting info
     mywc_info_t info = {0};
-    copy_file(pipefds[0], STDOUT_FILENO, &info);
+    forward_output(&mode, pipefds[0], STDOUT_FILENO, &info);
+    count_info_finish(&info);
 
-    // Waiting for child
-    if (wait(NULL) != pid) {
-        perror("waitpid");
+    // Waiting for child, wait4 also collects its resource usage
+    mywc_prof_t prof = {};
+    pid_t waited;
+    do
+    {
+        waited = wait4(pid, &prof.status, 0, &prof.usage);
+    } while (waited == -1 && errno == EINTR);
+    if (waited != pid) {
+        perror("wait4");
         return EXIT_FAILURE;
     }
 
     // End time
-    struct timeval end;
-    if (gettimeofday(&end, NULL) != 0)
+    struct timespec end;
+    if (clock_gettime(CLOCK_MONOTONIC, &end) != 0)
     {
-        perror("gettimeofday");
+        perror("clock_gettime");
         return EXIT_FAILURE;
     }
-    double msec_end = (double)end.tv_sec * 1000. + (double)end.tv_usec / 1000.;
-    double msec_start = (double)start.tv_sec * 1000. + (double)start.tv_usec / 1000.;
+    prof.wall_ms = (double)(end.tv_sec  - start.tv_sec)  * 1000. +
+                   (double)(end.tv_nsec - start.tv_nsec) / 1000000.;
+
+    if (mode.flag_json)
+    {
+        print_report_json(&mode, &info, &prof);
+    } else
+    {
+        print_report(&mode, &info, &prof);
+    }
+    return EXIT_SUCCESS;
+}
+
+static double
+timeval_ms(struct timeval tv)
+{
+    return (double)tv.tv_sec * 1000. + (double)tv.tv_usec / 1000.;
+}
+
+static double
+throughput(const mywc_info_t *info,
+           const mywc_prof_t *prof)
+{
+    return (prof->wall_ms > 0.) ? (double)info->bytes * 1000. / prof->wall_ms : 0.;
+}
+
+void
+print_hist(const size_t *line_hist)
+{
+    printf("\t-line lengths:\n");
+    for (int k = 0; k != HIST_BUCKETS; ++k)
+    {
+        if (line_hist[k] == 0)
+        {
+            continue;
+        }
+        if (k == 0)
+        {
+            printf("\t\t%20s: %lu\n", "0", line_hist[k]);
+        } else
+        {
+            char range[48] = {};
+            snprintf(range, sizeof(range), "%lu..%lu",
+                     1UL << (k - 1), (k == 64) ? ~0UL : (1UL << k) - 1);
+            printf("\t\t%20s: %lu\n", range, line_hist[k]);
+        }
+    }
+}
+
+void
+print_hist_json(const size_t *line_hist)
+{
+    // Trailing empty buckets are dropped
+    int last = HIST_BUCKETS - 1;
+    while (last > 0 && line_hist[last] == 0)
+    {
+        last--;
+    }
+    printf("\"line_length_log2_hist\": [");
+    for (int k = 0; k <= last; ++k)
+    {
+        printf("%s%lu", (k != 0) ? ", " : "", line_hist[k]);
+    }
+    printf("]");
+}
 
+void
+print_report(const mywc_mode_t *mode,
+             const mywc_info_t *info,
+             const mywc_prof_t *prof)
+{
     printf("=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=\n"
            "\t-time:  %lg ms\n"
            "\t-bytes: %lu\n"
            "\t-words: %lu\n"
-           "\t-lines: %lu\n"
-           "=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=\n",
-           msec_end - msec_start,
-           info.bytes,
-           info.words,
-           info.lines);
+           "\t-lines: %lu\n",
+           prof->wall_ms,
+           info->bytes,
+           info->words,
+           info->lines);
+    if (mode->flag_chars)
+    {
+        printf("\t-chars: %lu\n"
+               "\t-invalid utf-8: %lu\n",
+               info->chars,
+               info->invalid);
+    }
+    if (mode->flag_max)
+    {
+        printf("\t-max line: %lu\n", info->max_line);
+    }
+    if (mode->count_byte >= 0)
+    {
+        printf("\t-byte 0x%02x: %lu\n", mode->count_byte, info->byte_count);
+    }
+    if (mode->flag_hist)
+    {
+        print_hist(info->line_hist);
+    }
+    printf("-----------------------------------------\n"
+           "\t-user cpu:    %lg ms\n"
+           "\t-system cpu:  %lg ms\n"
+           "\t-max rss:     %ld KiB\n"
+           "\t-major flts:  %ld\n"
+           "\t-minor flts:  %ld\n"
+           "\t-vol csw:     %ld\n"
+           "\t-invol csw:   %ld\n"
+           "\t-throughput:  %lg bytes/s\n",
+           timeval_ms(prof->usage.ru_utime),
+           timeval_ms(prof->usage.ru_stime),
+           prof->usage.ru_maxrss,
+           prof->usage.ru_majflt,
+           prof->usage.ru_minflt,
+           prof->usage.ru_nvcsw,
+           prof->usage.ru_nivcsw,
+           throughput(info, prof));
+    if (WIFEXITED(prof->status))
+    {
+        printf("\t-exit code:   %d\n", WEXITSTATUS(prof->status));
+    } else if (WIFSIGNALED(prof->status))
+    {
+        printf("\t-signal:      %d\n", WTERMSIG(prof->status));
+    }
+    printf("=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=\n");
+}
+
+void
+print_report_json(const mywc_mode_t *mode,
+                  const mywc_info_t *info,
+                  const mywc_prof_t *prof)
+{
+    printf("{\"time_ms\": %.3f, \"bytes\": %lu, \"words\": %lu, \"lines\": %lu",
+           prof->wall_ms,
+           info->bytes,
+           info->words,
+           info->lines);
+    if (mode->flag_chars)
+    {
+        printf(", \"chars\": %lu, \"invalid_utf8\": %lu",
+               info->chars,
+               info->invalid);
+    }
+    if (mode->flag_max)
+    {
+        printf(", \"max_line_length\": %lu", info->max_line);
+    }
+    if (mode->count_byte >= 0)
+    {
+        printf(", \"byte\": %d, \"byte_count\": %lu", mode->count_byte, info->byte_count);
+    }
+    if (mode->flag_hist)
+    {
+        printf(", ");
+        print_hist_json(info->line_hist);
+    }
+    printf(", \"user_ms\": %.3f, \"system_ms\": %.3f, \"max_rss_kib\": %ld"
+           ", \"major_faults\": %ld, \"minor_faults\": %ld"
+           ", \"voluntary_csw\": %ld, \"involuntary_csw\": %ld"
+           ", \"bytes_per_sec\": %.1f",
+           timeval_ms(prof->usage.ru_utime),
+           timeval_ms(prof->usage.ru_stime),
+           prof->usage.ru_maxrss,
+           prof->usage.ru_majflt,
+           prof->usage.ru_minflt,
+           prof->usage.ru_nvcsw,
+           prof->usage.ru_nivcsw,
+           throughput(info, prof));
+    if (WIFEXITED(prof->status))
+    {
+        printf(", \"exit_code\": %d", WEXITSTATUS(prof->status));
+    } else if (WIFSIGNALED(prof->status))
+    {
+        printf(", \"signal\": %d", WTERMSIG(prof->status));
+    }
+    printf("}\n");
+}
+
+int
+get_flags(int          argc,
+          char* const* argv,
+          mywc_mode_t *mode)
+{
+    struct option long_options[] = {
+        {          "chars",       no_argument, NULL, 'm'},
+        {           "json",       no_argument, NULL, 'j'},
+        {"max-line-length",       no_argument, NULL, 'L'},
+        {      "histogram",       no_argument, NULL, 'H'},
+        {     "count-byte", required_argument, NULL, 'b'},
+        {          "files",       no_argument, NULL, 'f'},
+        {    "files0-from", required_argument, NULL, 'F'},
+        {        "threads", required_argument, NULL, 't'},
+        {0, 0, 0, 0},
+    };
+
+    int opt;
+    int option_index = 0;
+
+    // '+' stops at the first non-option, the rest belongs to the command
+    while ((opt = getopt_long(argc, argv, "+mjLHb:ft:", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'm': mode->flag_chars = true; break;
+            case 'j': mode->flag_json  = true; break;
+            case 'L': mode->flag_max   = true; break;
+            case 'H': mode->flag_hist  = true; break;
+            case 'b':
+            {
+                // A number like 0, 10, 0x0a, a literal character as c:X,
+                // or a single non-digit character such as ','
+                char *end = NULL;
+                long value = -1;
+                if (strncmp(optarg, "c:", 2) == 0 && optarg[2] != '\0' && optarg[3] == '\0')
+                {
+                    value = (unsigned char)optarg[2];
+                } else
+                {
+                    value = strtol(optarg, &end, 0);
+                    if (end == optarg && optarg[0] != '\0' && optarg[1] == '\0')
+                    {
+                        value = (unsigned char)optarg[0];
+                        end   = NULL;
+                    }
+                }
+                if ((end != NULL && (end == optarg || *end != '\0')) || value < 0 || value > 0xFF)
+                {
+                    fprintf(stderr, "invalid byte: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                mode->count_byte = (int)value;
+                break;
+            }
+            case 'f': mode->flag_files  = true;   break;
+            case 'F': mode->files0_from = optarg; break;
+            case 't':
+            {
+                char *end = NULL;
+                mode->threads = strtol(optarg, &end, 10);
+                if (*end != '\0' || mode->threads <= 0)
+                {
+                    fprintf(stderr, "invalid thread count: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case '?':
+            default:
+                return EXIT_FAILURE;
+        }
+    }
     return EXIT_SUCCESS;
 }
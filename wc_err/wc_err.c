@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -7,10 +8,40 @@
 #include <sys/time.h>
 #include <ctype.h>
 #include <stdbool.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 
 #define BUFFER_SIZE (4096)
+#define MAX_EVENTS  (64)
+#define MAX_STREAMS (64) // per command
+// A stream stops being read while this much of it waits for its output,
+// and is resumed once the backlog drops below the low mark
+#define QUEUE_HIGH_WATER (1 << 20)
+#define QUEUE_LOW_WATER  (1 << 16)
+// How often memfd transport looks for new data
+#define MEMFD_POLL_MS    (20)
+
+// Log-linear histogram: values below 8 exactly, then 8 buckets per power
+// of two, which keeps percentiles within 12.5% for any gap up to 2^64 ns
+#define LAT_BUCKETS (512)
+
+// Kind of descriptor in epoll_event.data.u64 (upper half), index in lower
+enum
+{
+    EV_READ  = 1,
+    EV_WRITE = 2,
+    EV_CHILD = 3, // pidfd of a command became readable, it has exited
+};
 
 typedef struct
 {
@@ -20,17 +51,232 @@ typedef struct
     bool   in_word;
 } mywc_info_t;
 
+// Line arrival times of one stream (-T)
+typedef struct
+{
+    uint64_t origin_ns;    // start of the command
+    uint64_t now_ns;       // arrival of the data being counted
+    uint64_t first_ns;     // arrival of the first byte, 0 if none yet
+    uint64_t last_ns;      // completion of the previous line, 0 if none yet
+    uint64_t max_gap;
+    size_t   ngaps;
+    size_t   gaps[LAT_BUCKETS];
+    FILE    *log;          // merged log (-l), NULL if not requested
+    int      child;
+    int      child_fd;
+    char    *partial;      // unfinished last line, only kept for the log
+    size_t   partial_size;
+    size_t   partial_cap;
+} mylat_t;
+
+typedef struct mychunk_t
+{
+    struct mychunk_t *next;
+    size_t            begin; // first byte not written yet
+    size_t            end;   // first free byte
+    char              data[BUFFER_SIZE];
+} mychunk_t;
+
+// Data read from a stream and not yet accepted by its output
+typedef struct
+{
+    mychunk_t *head;
+    mychunk_t *tail;
+    size_t     size;
+} myqueue_t;
+
+// Descriptor the data is passed to, several streams may share one
+typedef struct
+{
+    int  fd;
+    int  orig_flags; // restored at exit, the file is shared with our parent
+    bool pollable;   // false for regular files, they never return EAGAIN
+    bool blocked;    // last write got EAGAIN, waiting for EPOLLOUT
+} myoutput_t;
+
+typedef struct
+{
+    int         fd_from;  // read end in the parent, -1 once EOF is reached
+    int         out;      // index of the output, -1 to drop the data
+    int         child_fd; // descriptor number inside the child
+    int         child;    // index of the command the stream belongs to
+    bool        paused;   // queue is over QUEUE_HIGH_WATER, not reading
+    myqueue_t   queue;
+    mywc_info_t info;
+    mylat_t    *lat;      // NULL unless lines are timestamped
+    uint64_t    consumed; // memfd transport: bytes already counted and passed on
+} mystream_t;
+
+typedef struct
+{
+    const char      *label;        // command as shown in the report
+    char* const     *argv;
+    pid_t            pid;
+    int              pidfd;        // -1 if pidfd_open is not supported
+    int              status;
+    int              open_streams; // streams that did not reach EOF yet
+    bool             exited;       // reaped through the pidfd
+    bool             timed_out;    // killed after --timeout
+    struct timespec  start;
+    struct timespec  end;          // exit time, or last EOF without pidfd
+} mychild_t;
+
+typedef struct
+{
+    int          nstreams;         // stdout, stderr and every -x fd
+    int          child_fds[MAX_STREAMS];
+    long         repeat;           // -n: every command is started this many times
+    int          ncmds;            // -c: shell command lines
+    const char **cmds;
+    bool         flag_timestamps;  // -T: line arrival times and gap percentiles
+    FILE        *log;              // -l: timestamped merged log of all streams
+    double       timeout;          // -t: seconds before the commands are killed, 0 is none
+    bool         flag_memfd;       // -M: children write into memfds instead of pipes
+    bool         flag_bench;       // -B: time pipe and memfd transport on the commands
+} mywc_mode_t;
+
+int get_flags( int argc, char* const* argv, mywc_mode_t *mode);
+int spawn_child( const mywc_mode_t *mode, mychild_t *child, mystream_t *streams);
+int run_commands( const mywc_mode_t *mode, mychild_t *children, int nchildren,
+                  mystream_t *streams, myoutput_t *outputs, int noutputs);
+int run_benchmark( mywc_mode_t *mode, mychild_t *children, int nchildren, mystream_t *streams);
+void print_streams( const mywc_mode_t *mode, const mystream_t *streams);
+
+uint64_t
+monotonic_ns( void)
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+size_t
+lat_bucket( uint64_t value)
+{
+    if ( value < 8 )
+    {
+        return value;
+    }
+    int k = 63 - __builtin_clzll( value);
+    return 8 + (k - 3) * 8 + ((value >> (k - 3)) & 7);
+}
+
+// Largest value that falls into the bucket
+uint64_t
+lat_bucket_max( size_t bucket)
+{
+    if ( bucket < 8 )
+    {
+        return bucket;
+    }
+    int      k   = (bucket - 8) / 8 + 3;
+    uint64_t sub = (bucket - 8) % 8;
+    return ((8 + sub + 1) << (k - 3)) - 1;
+}
+
+double
+lat_percentile_ms( const mylat_t *lat,
+                   double         percent)
+{
+    if ( lat->ngaps == 0 )
+    {
+        return 0.;
+    }
+    size_t rank = (size_t)(percent / 100. * (lat->ngaps - 1)) + 1;
+    size_t seen = 0;
+    for ( size_t b = 0; b != LAT_BUCKETS; ++b )
+    {
+        seen += lat->gaps[b];
+        if ( seen >= rank )
+        {
+            uint64_t value = lat_bucket_max( b);
+            return (double)(( value < lat->max_gap ) ? value : lat->max_gap) / 1000000.;
+        }
+    }
+    return (double)lat->max_gap / 1000000.;
+}
+
+void
+lat_log_fragment( mylat_t    *lat,
+                  const char *data,
+                  size_t      size)
+{
+    if ( lat->partial_size + size > lat->partial_cap )
+    {
+        size_t cap = ( lat->partial_cap != 0 ) ? lat->partial_cap : 256;
+        while ( cap < lat->partial_size + size )
+        {
+            cap *= 2;
+        }
+        char *partial = (char *)realloc( lat->partial, cap);
+        if ( partial == NULL )
+        {
+            return;
+        }
+        lat->partial     = partial;
+        lat->partial_cap = cap;
+    }
+    memcpy( lat->partial + lat->partial_size, data, size);
+    lat->partial_size += size;
+}
+
+void
+lat_log_line( mylat_t    *lat,
+              const char *line,
+              size_t      size)
+{
+    fprintf( lat->log, "%.6f [%d] %d ",
+             (double)(lat->now_ns - lat->origin_ns) / 1e9, lat->child, lat->child_fd);
+    if ( lat->partial_size != 0 )
+    {
+        fwrite( lat->partial, 1, lat->partial_size, lat->log);
+    }
+    fwrite( line, 1, size, lat->log);
+    lat->partial_size = 0;
+}
+
+// Line ending at line + size (newline included) arrived at lat->now_ns
+void
+lat_line( mylat_t    *lat,
+          const char *line,
+          size_t      size)
+{
+    if ( lat->last_ns != 0 )
+    {
+        uint64_t gap = lat->now_ns - lat->last_ns;
+        lat->gaps[lat_bucket( gap)]++;
+        lat->ngaps++;
+        if ( gap > lat->max_gap )
+        {
+            lat->max_gap = gap;
+        }
+    }
+    lat->last_ns = lat->now_ns;
+    if ( lat->log != NULL )
+    {
+        lat_log_line( lat, line, size);
+    }
+}
+
+// Counts the chunk; with lat every line is also timestamped in this pass
 void
 count_info(char        *buffer,
            size_t       readsz,
-           mywc_info_t *info)
+           mywc_info_t *info,
+           mylat_t     *lat)
 {
     info->bytes += readsz;
+    size_t line_start = 0;
     for ( ssize_t i = 0; i < readsz; ++i )
     {
         if ( buffer[i] == '\n' )
         {
             info->lines++;
+            if ( lat != NULL )
+            {
+                lat_line( lat, buffer + line_start, i + 1 - line_start);
+                line_start = i + 1;
+            }
         }
         if ( !isspace(buffer[i]) )
         {
@@ -44,171 +290,1305 @@ count_info(char        *buffer,
             info->in_word = false;
         }
     }
+    if ( lat != NULL && lat->log != NULL && line_start != readsz )
+    {
+        lat_log_fragment( lat, buffer + line_start, readsz - line_start);
+    }
 }
 
 int
-copy_files(int          count,    // Number of files to read
-           int         *fds_from, // array of descriptors to read from
-           int         *fds_to,   // array of descriptors to write to
-           mywc_info_t *info)     // array of structures to place info
+set_nonblock( int fd)
 {
-    int fds_max = -1;
-    for ( int i = 0; i != count; ++i )
+    int flags = fcntl( fd, F_GETFL);
+    if ( flags == -1 || fcntl( fd, F_SETFL, flags | O_NONBLOCK) == -1 )
+    {
+        perror( "fcntl");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Returns writable space at the tail of the queue
+char *
+queue_reserve( myqueue_t *queue,
+               size_t    *space)
+{
+    if ( queue->tail == NULL || queue->tail->end == BUFFER_SIZE )
     {
-        if ( fds_from[i] > fds_max )
+        mychunk_t *chunk = (mychunk_t *)malloc( sizeof( *chunk));
+        if ( chunk == NULL )
+        {
+            return NULL;
+        }
+        chunk->next  = NULL;
+        chunk->begin = 0;
+        chunk->end   = 0;
+        if ( queue->tail != NULL )
+        {
+            queue->tail->next = chunk;
+        } else
         {
-            fds_max = fds_from[i];
+            queue->head = chunk;
         }
+        queue->tail = chunk;
     }
+    *space = BUFFER_SIZE - queue->tail->end;
+    return queue->tail->data + queue->tail->end;
+}
 
-    fd_set readfds;
-    char buffer[BUFFER_SIZE];
-    int nfiles = count;
+void
+queue_commit( myqueue_t *queue,
+              size_t     size)
+{
+    queue->tail->end += size;
+    queue->size      += size;
+}
 
-    while ( nfiles != 0 )
+void
+queue_clear( myqueue_t *queue)
+{
+    while ( queue->head != NULL )
     {
-        FD_ZERO( &readfds);
-        for ( int i = 0; i != count; ++i )
+        mychunk_t *next = queue->head->next;
+        free( queue->head);
+        queue->head = next;
+    }
+    queue->tail = NULL;
+    queue->size = 0;
+}
+
+// Writes queued data until it is empty or the output would block
+int
+flush_stream( mystream_t *stream,
+              myoutput_t *outputs)
+{
+    if ( stream->out == -1 )
+    {
+        return EXIT_SUCCESS;
+    }
+    myoutput_t *output = &outputs[stream->out];
+    myqueue_t  *queue  = &stream->queue;
+    while ( queue->head != NULL && !output->blocked )
+    {
+        mychunk_t *chunk = queue->head;
+        ssize_t write_bytes = write( output->fd, chunk->data + chunk->begin, chunk->end - chunk->begin);
+        if ( write_bytes < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                output->blocked = true;
+                break;
+            }
+            // Consumer is gone (EPIPE and alike), keep counting without it
+            perror( "Writing error");
+            queue_clear( queue);
+            stream->out = -1;
+            return EXIT_FAILURE;
+        }
+        chunk->begin += write_bytes;
+        queue->size  -= write_bytes;
+        if ( chunk->begin == chunk->end )
+        {
+            queue->head = chunk->next;
+            if ( queue->head == NULL )
+            {
+                queue->tail = NULL;
+            }
+            free( chunk);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// Reads fd until EAGAIN, as required with edge-triggered epoll, or until
+// too much of it is queued for a slow output. The data is read straight
+// into the output queue and counted there.
+// Returns true once the stream is finished (EOF or read error).
+bool
+drain_stream( mystream_t *stream,
+              myoutput_t *outputs,
+              char       *scratch)
+{
+    while ( true )
+    {
+        if ( stream->out != -1 && stream->queue.size >= QUEUE_HIGH_WATER )
         {
-            FD_SET( fds_from[i], &readfds);
+            flush_stream( stream, outputs);
+            if ( stream->out != -1 && stream->queue.size >= QUEUE_HIGH_WATER )
+            {
+                // Resumed by the EPOLLOUT of the output
+                stream->paused = true;
+                return false;
+            }
         }
 
-        int ready = select( fds_max + 1, &readfds, NULL, NULL, NULL);
-        if ( ready == -1 )
+        char  *buffer = scratch;
+        size_t space  = BUFFER_SIZE;
+        if ( stream->out != -1 )
         {
-            perror( "Select");
-            return EXIT_FAILURE;
+            buffer = queue_reserve( &stream->queue, &space);
+            if ( buffer == NULL )
+            {
+                perror( "malloc");
+                return true;
+            }
         }
 
-        for ( int i = 0; i != count; ++i )
+        ssize_t read_bytes = read( stream->fd_from, buffer, space);
+        if ( read_bytes > 0 )
         {
-            if ( FD_ISSET( fds_from[i], &readfds) )
+            if ( stream->lat != NULL )
             {
-                ssize_t read_bytes = read( fds_from[i], buffer, BUFFER_SIZE);
-                if ( read_bytes <= 0 )
+                // One clock read per chunk, all its lines arrived together
+                stream->lat->now_ns = monotonic_ns();
+                if ( stream->lat->first_ns == 0 )
                 {
-                    if ( read_bytes < 0 )
-                    {
-                        perror( "Reading error");
-                    }
-                    nfiles--;
-                    close(fds_from[i]);
-                    fds_from[i] = -1;
-                    continue;
+                    stream->lat->first_ns = stream->lat->now_ns;
                 }
+            }
+            count_info( buffer, read_bytes, &stream->info, stream->lat);
+            if ( stream->out != -1 )
+            {
+                queue_commit( &stream->queue, read_bytes);
+            }
+            continue;
+        }
+        if ( read_bytes < 0 )
+        {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                return false;
+            }
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            perror( "Reading error");
+        }
+        return true;
+    }
+}
 
-                count_info( buffer, read_bytes, &info[i]);
+void
+add_output( mystream_t *stream,
+            myoutput_t *outputs,
+            int        *noutputs,
+            int         fd)
+{
+    stream->out = -1;
+    if ( fd == -1 )
+    {
+        return;
+    }
+    for ( int o = 0; o != *noutputs; ++o )
+    {
+        if ( outputs[o].fd == fd )
+        {
+            stream->out = o;
+            return;
+        }
+    }
+    outputs[*noutputs] = (myoutput_t){ .fd = fd, .orig_flags = fcntl( fd, F_GETFL) };
+    stream->out = (*noutputs)++;
+}
 
-                // ssize_t written = 0;
-                // while ( written < read_bytes )
-                // {
-                //     ssize_t write_bytes = write( fds_to[i], buffer + written, read_bytes - written);
-                //     if ( write_bytes < 0 )
-                //     {
-                //         perror( "Writing error");
-                //         return EXIT_FAILURE;
-                //     }
-                //     written += write_bytes;
-                // }
-            }
+void
+restore_outputs( myoutput_t *outputs,
+                 int         noutputs)
+{
+    for ( int o = 0; o != noutputs; ++o )
+    {
+        if ( outputs[o].orig_flags != -1 )
+        {
+            fcntl( outputs[o].fd, F_SETFL, outputs[o].orig_flags);
         }
     }
-    return EXIT_SUCCESS;
 }
 
-int
-main(int          argc,
-     char* const* argv) {
-    if ( argc < 2 )
+double
+elapsed_ms( const struct timespec *start,
+            const struct timespec *end)
+{
+    return (double)(end->tv_sec  - start->tv_sec)  * 1000. +
+           (double)(end->tv_nsec - start->tv_nsec) / 1000000.;
+}
+
+// Stream reached EOF, its command is done once all its streams are
+void
+finish_stream( mystream_t *stream,
+               mychild_t  *children)
+{
+    // Closing also removes the fd from the epoll set
+    close( stream->fd_from);
+    stream->fd_from = -1;
+
+    // Unterminated last line still goes to the log
+    mylat_t *lat = stream->lat;
+    if ( lat != NULL && lat->log != NULL && lat->partial_size != 0 )
     {
-        fprintf( stderr, "usage: %s [proc]", argv[0] );
-        return EXIT_FAILURE;
+        lat_log_line( lat, "\n", 1);
     }
 
-    int pipefds_stdout[2];
-    if ( pipe(pipefds_stdout) != 0 )
+    mychild_t *child = &children[stream->child];
+    if ( --child->open_streams == 0 && child->pidfd == -1 && !child->exited )
     {
-        perror("pipefds_stdout");
-        return EXIT_FAILURE;
+        clock_gettime( CLOCK_MONOTONIC, &child->end);
     }
+}
 
-    int pipefds_stderr[2];
-    if ( pipe(pipefds_stderr) != 0 )
+// Reads what is available and passes it on. Once the command has exited
+// nothing more is waited for: the pipe may be held open by a daemonized
+// grandchild, so the stream is finished as soon as it is empty.
+void
+service_stream( mystream_t *stream,
+                myoutput_t *outputs,
+                mychild_t  *children,
+                char       *scratch,
+                int        *nfiles)
+{
+    if ( stream->fd_from != -1 && !stream->paused )
     {
-        perror( "pipefds_stderr" );
-        return EXIT_FAILURE;
+        bool finished = drain_stream( stream, outputs, scratch);
+        if ( finished || (children[stream->child].exited && !stream->paused) )
+        {
+            finish_stream( stream, children);
+            (*nfiles)--;
+        }
+    }
+    flush_stream( stream, outputs);
+}
+
+// Kills the process group of every command that is still running. A
+// command that has exited but is not reaped yet finished in time: waitid
+// with WNOWAIT sees it and leaves the reaping to the event loop.
+void
+kill_children( mychild_t *children,
+               int        nchildren)
+{
+    for ( int c = 0; c != nchildren; ++c )
+    {
+        if ( children[c].exited )
+        {
+            continue;
+        }
+        siginfo_t info = {};
+        int found = ( children[c].pidfd != -1 )
+                    ? waitid( P_PIDFD, children[c].pidfd, &info, WEXITED | WNOHANG | WNOWAIT)
+                    : waitid( P_PID,   children[c].pid,   &info, WEXITED | WNOHANG | WNOWAIT);
+        if ( found == 0 && info.si_pid != 0 )
+        {
+            continue;
+        }
+        children[c].timed_out = true;
+        kill( -children[c].pid, SIGKILL);
+        kill(  children[c].pid, SIGKILL);
     }
+}
 
-    // Start time
-    struct timeval start;
-    if ( gettimeofday(&start, NULL) != 0 ) {
-        perror( "gettimeofday" );
-        return EXIT_FAILURE;
+bool
+has_pending( mystream_t *streams,
+             int         count)
+{
+    for ( int i = 0; i != count; ++i )
+    {
+        if ( streams[i].out != -1 && streams[i].queue.size != 0 )
+        {
+            return true;
+        }
     }
+    return false;
+}
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Closing read ds for child
-        close( pipefds_stdout[0] );
-        close( pipefds_stderr[0] );
-        // Dupping write fd to stdout (1)
-        dup2( pipefds_stdout[1], STDOUT_FILENO );
-        dup2( pipefds_stderr[1], STDERR_FILENO );
+// Collects the exit status once the pidfd reports it. The pidfd is taken
+// out of epfd before closing: a command forked later may still hold a copy
+// of it, and the registration would then outlive our close and keep firing.
+bool
+reap_child( mychild_t *child,
+            int        epfd)
+{
+    pid_t waited = waitpid( child->pid, &child->status, WNOHANG);
+    if ( waited == 0 )
+    {
+        return false;
+    }
+    if ( waited != child->pid )
+    {
+        perror( "waitpid");
+    }
+    clock_gettime( CLOCK_MONOTONIC, &child->end);
+    child->exited = true;
+    if ( child->pidfd != -1 )
+    {
+        epoll_ctl( epfd, EPOLL_CTL_DEL, child->pidfd, NULL);
+        close( child->pidfd);
+        child->pidfd = -1;
+    }
+    return true;
+}
 
-        close(pipefds_stdout[1]);
-        close(pipefds_stderr[1]);
-        // Runtting program in child proccess
-        execvp( argv[1], argv + 1 );
-        // Failure if was here
-        return EXIT_FAILURE;
+// Outputs become non-blocking, so a slow one never stalls the loop.
+// Regular files cannot be polled and never block anyway.
+void
+watch_outputs( int         epfd,
+               myoutput_t *outputs,
+               int         noutputs)
+{
+    for ( int o = 0; o != noutputs; ++o )
+    {
+        struct epoll_event ev = { .events = EPOLLOUT | EPOLLET,
+                                  .data.u64 = ((uint64_t)EV_WRITE << 32) | o };
+        if ( epoll_ctl( epfd, EPOLL_CTL_ADD, outputs[o].fd, &ev) == 0 )
+        {
+            outputs[o].pollable = true;
+            set_nonblock( outputs[o].fd);
+        }
     }
-    // Closing write fd for parent
-    close( pipefds_stdout[1] );
-    close( pipefds_stderr[1] );
+}
 
-    // Copying pipe to stdout and counting info
-    int fds_from[2]     = { pipefds_stdout[0], pipefds_stderr[0] };
-    int fds_to[2]       = { STDOUT_FILENO, STDERR_FILENO };
-    mywc_info_t info[2] = { {}, {} };
+// Output accepts data again: flushes every stream queued on it and
+// resumes the ones paused by back pressure. Only pipe streams are ever
+// paused, the memfd loop passes no scratch buffer.
+void
+output_ready( int         index,
+              mystream_t *streams,
+              int         count,
+              myoutput_t *outputs,
+              mychild_t  *children,
+              char       *scratch,
+              int        *nfiles)
+{
+    outputs[index].blocked = false;
+    for ( int i = 0; i != count; ++i )
+    {
+        mystream_t *stream = &streams[i];
+        if ( stream->out != index )
+        {
+            continue;
+        }
+        flush_stream( stream, outputs);
+        if ( stream->paused && stream->queue.size < QUEUE_LOW_WATER )
+        {
+            stream->paused = false;
+            service_stream( stream, outputs, children, scratch, nfiles);
+        }
+    }
+}
 
+// Counts what the child appended to its memfd since the last call. The
+// new range is mapped and counted in place, passed on with sendfile and
+// then punched out of the memfd, so memory stays bounded while the child
+// keeps appending after it. What a blocked output does not take goes to
+// the stream queue like pipe data; nothing is consumed while the queue is
+// over QUEUE_HIGH_WATER, the data then waits in the memfd.
+// Returns true once everything written so far is consumed.
+bool
+consume_memfd( mystream_t *stream,
+               myoutput_t *outputs)
+{
+    if ( stream->out != -1 )
+    {
+        flush_stream( stream, outputs);
+        if ( stream->out != -1 && stream->queue.size >= QUEUE_HIGH_WATER )
+        {
+            return false;
+        }
+    }
 
-    copy_files( 2, fds_from, fds_to, info);
+    struct stat st;
+    if ( fstat( stream->fd_from, &st) != 0 )
+    {
+        perror( "fstat");
+        return true;
+    }
+    uint64_t size = st.st_size;
+    if ( size <= stream->consumed )
+    {
+        return true;
+    }
 
-    // Waiting for child
-    if ( wait(NULL) != pid ) {
-        perror("waitpid");
-        return EXIT_FAILURE;
+    uint64_t page      = sysconf( _SC_PAGESIZE);
+    uint64_t map_start = stream->consumed & ~(page - 1);
+    size_t   map_len   = size - map_start;
+    char    *map = (char *)mmap( NULL, map_len, PROT_READ, MAP_SHARED, stream->fd_from, map_start);
+    if ( map == MAP_FAILED )
+    {
+        perror( "mmap");
+        return true;
     }
+    madvise( map, map_len, MADV_SEQUENTIAL);
 
-    // End time
-    struct timeval end;
-    if (gettimeofday(&end, NULL) != 0)
+    if ( stream->lat != NULL )
     {
-        perror("gettimeofday");
-        return EXIT_FAILURE;
+        stream->lat->now_ns = monotonic_ns();
+        if ( stream->lat->first_ns == 0 )
+        {
+            stream->lat->first_ns = stream->lat->now_ns;
+        }
     }
-    double msec_end   = (double)end.tv_sec   * 1000. + (double)end.tv_usec   / 1000.;
-    double msec_start = (double)start.tv_sec * 1000. + (double)start.tv_usec / 1000.;
+    const char *data = map + (stream->consumed - map_start);
+    count_info( (char *)data, size - stream->consumed, &stream->info, stream->lat);
 
-    printf("╔═══════════════════════════════════════╗\n"
-           "║ Time  %lg ms                          ║\n"
-           "╟───────────────────────────────────────╢\n"
-           "║\tSTDERR:                              ║\n"
-           "║\t\t-bytes: % 10lu                     ║\n"
-           "║\t\t-words: % 10lu                     ║\n"
-           "║\t\t-lines: % 10lu                     ║\n"
-           "╟───────────────────────────────────────╢\n"
-           "║\tSTDERR:                              ║\n"
-           "║\t\t-bytes: % 10lu                     ║\n"
-           "║\t\t-words: % 10lu                     ║\n"
-           "║\t\t-lines: % 10lu                     ║\n"
-           "╚═══════════════════════════════════════╝\n",
-           msec_end - msec_start,
-           info[0].bytes,
-           info[0].words,
-           info[0].lines,
-           info[1].bytes,
-           info[1].words,
-           info[1].lines);
+    if ( stream->out != -1 )
+    {
+        myoutput_t *output = &outputs[stream->out];
+        off_t       offset = stream->consumed;
+        // Queued data goes first, the new range is appended after it
+        while ( offset < (off_t)size && stream->queue.size == 0 && !output->blocked )
+        {
+            ssize_t sent = sendfile( output->fd, stream->fd_from, &offset, size - offset);
+            if ( sent < 0 && errno == EINVAL )
+            {
+                // Output does not take splice (a tty for one), plain write
+                sent = write( output->fd, map + (offset - map_start), size - offset);
+                if ( sent > 0 )
+                {
+                    offset += sent;
+                }
+            }
+            if ( sent < 0 )
+            {
+                if ( errno == EINTR )
+                {
+                    continue;
+                }
+                if ( errno == EAGAIN || errno == EWOULDBLOCK )
+                {
+                    output->blocked = true;
+                    break;
+                }
+                perror( "Writing error");
+                stream->out = -1;
+                break;
+            }
+        }
+        while ( stream->out != -1 && offset < (off_t)size )
+        {
+            size_t space = 0;
+            char  *tail  = queue_reserve( &stream->queue, &space);
+            if ( tail == NULL )
+            {
+                perror( "malloc");
+                queue_clear( &stream->queue);
+                stream->out = -1;
+                break;
+            }
+            if ( space > size - offset )
+            {
+                space = size - offset;
+            }
+            memcpy( tail, map + (offset - map_start), space);
+            queue_commit( &stream->queue, space);
+            offset += space;
+        }
+    }
+    munmap( map, map_len);
+
+    uint64_t release = size & ~(page - 1);
+    if ( release > map_start )
+    {
+        fallocate( stream->fd_from, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   map_start, release - map_start);
+    }
+    stream->consumed = size;
+    return true;
+}
+
+// Event loop of memfd transport: there is nothing to wait for on a
+// regular file, so the loop wakes on child exits and every MEMFD_POLL_MS.
+int
+copy_memfds(int                count,
+            mystream_t        *streams,
+            myoutput_t        *outputs,
+            int                noutputs,
+            mychild_t         *children,
+            int                nchildren,
+            const mywc_mode_t *mode)
+{
+    int epfd = epoll_create1( EPOLL_CLOEXEC);
+    if ( epfd == -1 )
+    {
+        perror( "epoll_create1");
+        return EXIT_FAILURE;
+    }
+    watch_outputs( epfd, outputs, noutputs);
+    for ( int c = 0; c != nchildren; ++c )
+    {
+        struct epoll_event ev = { .events = EPOLLIN,
+                                  .data.u64 = ((uint64_t)EV_CHILD << 32) | c };
+        if ( children[c].pidfd != -1 &&
+             epoll_ctl( epfd, EPOLL_CTL_ADD, children[c].pidfd, &ev) == -1 )
+        {
+            perror( "epoll_ctl");
+        }
+    }
+
+    uint64_t deadline_ns = 0;
+    if ( mode->timeout > 0 )
+    {
+        deadline_ns = monotonic_ns() + (uint64_t)(mode->timeout * 1e9);
+    }
+
+    int nfiles = count;
+    struct epoll_event events[MAX_EVENTS];
+    while ( nfiles != 0 || has_pending( streams, count) )
+    {
+        if ( deadline_ns != 0 && monotonic_ns() >= deadline_ns )
+        {
+            kill_children( children, nchildren);
+            deadline_ns = 0;
+        }
+        int ready = epoll_wait( epfd, events, MAX_EVENTS, MEMFD_POLL_MS);
+        if ( ready == -1 && errno != EINTR )
+        {
+            perror( "epoll_wait");
+            close( epfd);
+            return EXIT_FAILURE;
+        }
+        for ( int e = 0; e < ready; ++e )
+        {
+            if ( (events[e].data.u64 >> 32) == EV_WRITE )
+            {
+                output_ready( (uint32_t)events[e].data.u64, streams, count, outputs,
+                              children, NULL, NULL);
+            }
+        }
+
+        // Children without pidfd are polled, pidfd only saves the wait
+        for ( int c = 0; c != nchildren; ++c )
+        {
+            if ( !children[c].exited )
+            {
+                reap_child( &children[c], epfd);
+            }
+        }
+        for ( int i = 0; i != count; ++i )
+        {
+            mystream_t *stream = &streams[i];
+            if ( stream->fd_from == -1 )
+            {
+                continue;
+            }
+            // Exit status is read before the size, so nothing is missed
+            bool exited = children[stream->child].exited;
+            if ( consume_memfd( stream, outputs) && exited )
+            {
+                finish_stream( stream, children);
+                nfiles--;
+            }
+        }
+    }
+    close( epfd);
+    return EXIT_SUCCESS;
+}
+
+int
+copy_files(int                count,     // Number of streams to read
+           mystream_t        *streams,   // streams, counters are updated in place
+           myoutput_t        *outputs,   // descriptors streams are passed through to
+           int                noutputs,
+           mychild_t         *children,  // commands the streams belong to
+           int                nchildren,
+           const mywc_mode_t *mode)
+{
+    int epfd = epoll_create1( EPOLL_CLOEXEC);
+    if ( epfd == -1 )
+    {
+        perror( "epoll_create1");
+        return EXIT_FAILURE;
+    }
+
+    watch_outputs( epfd, outputs, noutputs);
+
+    int nfiles = 0;
+    for ( int i = 0; i != count; ++i )
+    {
+        if ( streams[i].fd_from == -1 )
+        {
+            continue;
+        }
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLET,
+                                  .data.u64 = ((uint64_t)EV_READ << 32) | i };
+        if ( set_nonblock( streams[i].fd_from) != EXIT_SUCCESS ||
+             epoll_ctl( epfd, EPOLL_CTL_ADD, streams[i].fd_from, &ev) == -1 )
+        {
+            perror( "epoll_ctl");
+            close( epfd);
+            return EXIT_FAILURE;
+        }
+        nfiles++;
+    }
+
+    // Exit of every command is an event too, the loop runs until all of
+    // them are reaped even if their pipes are still held by someone else
+    int nalive = 0;
+    for ( int c = 0; c != nchildren; ++c )
+    {
+        if ( children[c].pidfd == -1 )
+        {
+            continue;
+        }
+        struct epoll_event ev = { .events = EPOLLIN,
+                                  .data.u64 = ((uint64_t)EV_CHILD << 32) | c };
+        if ( epoll_ctl( epfd, EPOLL_CTL_ADD, children[c].pidfd, &ev) == -1 )
+        {
+            perror( "epoll_ctl");
+            close( children[c].pidfd);
+            children[c].pidfd = -1;
+            continue;
+        }
+        nalive++;
+    }
+
+    uint64_t deadline_ns = 0;
+    if ( mode->timeout > 0 )
+    {
+        deadline_ns = monotonic_ns() + (uint64_t)(mode->timeout * 1e9);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    char scratch[BUFFER_SIZE];
+
+    while ( nfiles != 0 || nalive != 0 || has_pending( streams, count) )
+    {
+        int wait_ms = -1;
+        if ( deadline_ns != 0 )
+        {
+            uint64_t now_ns = monotonic_ns();
+            if ( now_ns >= deadline_ns )
+            {
+                kill_children( children, nchildren);
+                deadline_ns = 0;
+                continue;
+            }
+            wait_ms = (int)((deadline_ns - now_ns + 999999) / 1000000);
+        }
+
+        int ready = epoll_wait( epfd, events, MAX_EVENTS, wait_ms);
+        if ( ready == -1 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            perror( "epoll_wait");
+            close( epfd);
+            return EXIT_FAILURE;
+        }
+
+        // Only descriptors that actually became ready are visited
+        for ( int e = 0; e != ready; ++e )
+        {
+            uint32_t kind  = events[e].data.u64 >> 32;
+            uint32_t index = (uint32_t)events[e].data.u64;
+
+            if ( kind == EV_WRITE )
+            {
+                output_ready( index, streams, count, outputs, children, scratch, &nfiles);
+                continue;
+            }
+
+            if ( kind == EV_CHILD )
+            {
+                if ( children[index].exited || !reap_child( &children[index], epfd) )
+                {
+                    continue;
+                }
+                nalive--;
+
+                // Whatever it wrote is in the pipes already
+                mystream_t *own = streams + index * mode->nstreams;
+                for ( int j = 0; j != mode->nstreams; ++j )
+                {
+                    service_stream( &own[j], outputs, children, scratch, &nfiles);
+                }
+                continue;
+            }
+
+            service_stream( &streams[index], outputs, children, scratch, &nfiles);
+        }
+    }
+    close( epfd);
+    return EXIT_SUCCESS;
+}
+
+const char *
+stream_name( const mystream_t *stream,
+             char             *buffer,
+             size_t            size)
+{
+    switch ( stream->child_fd )
+    {
+        case STDOUT_FILENO: return "STDOUT";
+        case STDERR_FILENO: return "STDERR";
+        default:
+            snprintf( buffer, size, "FD %d", stream->child_fd);
+            return buffer;
+    }
+}
+
+int
+main(int          argc,
+     char* const* argv) {
+    mywc_mode_t mode = { .nstreams = 2, .child_fds = { STDOUT_FILENO, STDERR_FILENO }, .repeat = 1 };
+    if ( get_flags( argc, argv, &mode) != 0 || (optind >= argc && mode.ncmds == 0) )
+    {
+        fprintf( stderr, "usage: %s [-TMB] [-l log] [-t seconds] [-x fd]... [-n count] [-c 'command']... [proc]\n", argv[0] );
+        free( mode.cmds);
+        return EXIT_FAILURE;
+    }
+    // Benchmark measures transport only
+    if ( mode.flag_bench )
+    {
+        mode.flag_timestamps = false;
+    }
+
+    // Every -c line is run by the shell, the trailing command as is
+    int ncommands = mode.ncmds + ( optind < argc );
+    int nchildren = ncommands * mode.repeat;
+    int nstreams  = nchildren * mode.nstreams;
+
+    mychild_t  *children = (mychild_t  *)calloc( nchildren, sizeof( *children));
+    mystream_t *streams  = (mystream_t *)calloc( nstreams,  sizeof( *streams));
+    char      **sh_argv  = (char      **)calloc( 4 * mode.ncmds, sizeof( *sh_argv));
+    if ( children == NULL || streams == NULL || (sh_argv == NULL && mode.ncmds != 0) )
+    {
+        perror( "calloc");
+        return EXIT_FAILURE;
+    }
+    for ( int c = 0; c != nchildren; ++c )
+    {
+        int cmd = c / mode.repeat;
+        if ( cmd < mode.ncmds )
+        {
+            char **sh = sh_argv + 4 * cmd;
+            sh[0] = "sh";
+            sh[1] = "-c";
+            sh[2] = (char *)mode.cmds[cmd];
+            sh[3] = NULL;
+            children[c].argv  = sh;
+            children[c].label = mode.cmds[cmd];
+        } else
+        {
+            children[c].argv  = argv + optind;
+            children[c].label = argv[optind];
+        }
+    }
+
+    // Each child has a pipe per stream, so allow as many fds as we may
+    struct rlimit nofile;
+    if ( getrlimit( RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max )
+    {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &nofile);
+    }
+
+    // Stdout and stderr of all children go to ours, extra fds are dropped
+    myoutput_t outputs[2] = {};
+    int        noutputs   = 0;
+    for ( int i = 0; i != nstreams; ++i )
+    {
+        int slot = i % mode.nstreams;
+        add_output( &streams[i], outputs, &noutputs, ( slot < 2 ) ? mode.child_fds[slot] : -1);
+        streams[i].child_fd = mode.child_fds[slot];
+        streams[i].child    = i / mode.nstreams;
+        if ( mode.flag_timestamps )
+        {
+            streams[i].lat = (mylat_t *)calloc( 1, sizeof( mylat_t));
+            if ( streams[i].lat == NULL )
+            {
+                perror( "calloc");
+                return EXIT_FAILURE;
+            }
+            streams[i].lat->log      = mode.log;
+            streams[i].lat->child    = streams[i].child;
+            streams[i].lat->child_fd = streams[i].child_fd;
+        }
+    }
+
+    if ( mode.flag_bench )
+    {
+        int status = run_benchmark( &mode, children, nchildren, streams);
+        free( streams);
+        free( children);
+        free( sh_argv);
+        free( mode.cmds);
+        return status;
+    }
+
+    // Start time
+    struct timespec start;
+    if ( clock_gettime( CLOCK_MONOTONIC, &start) != 0 ) {
+        perror( "clock_gettime" );
+        return EXIT_FAILURE;
+    }
+
+    int started = run_commands( &mode, children, nchildren, streams, outputs, noutputs);
+
+    // End time
+    struct timespec end;
+    if ( clock_gettime( CLOCK_MONOTONIC, &end) != 0 )
+    {
+        perror( "clock_gettime");
+        return EXIT_FAILURE;
+    }
+
+    // Like a test runner: any command that failed, was killed or timed out
+    // fails the whole run
+    int status = ( started == nchildren ) ? EXIT_SUCCESS : EXIT_FAILURE;
+    for ( int c = 0; c != started; ++c )
+    {
+        const mychild_t *child = &children[c];
+        if ( child->timed_out || !WIFEXITED( child->status) || WEXITSTATUS( child->status) != 0 )
+        {
+            status = EXIT_FAILURE;
+        }
+    }
+    if ( started == 1 )
+    {
+        printf("╔═══════════════════════════════════════╗\n"
+               "║ Time  %lg ms%s\n",
+               elapsed_ms( &start, &end),
+               children[0].timed_out ? ", killed by timeout" : "");
+        print_streams( &mode, streams);
+        printf("╚═══════════════════════════════════════╝\n");
+    } else
+    {
+        // Per command, then totals over all of them
+        mystream_t total[MAX_STREAMS] = {};
+        mylat_t   *total_lat = NULL;
+        if ( mode.flag_timestamps )
+        {
+            total_lat = (mylat_t *)calloc( mode.nstreams, sizeof( *total_lat));
+        }
+        for ( int c = 0; c != started; ++c )
+        {
+            const mychild_t *child = &children[c];
+            printf("╔═══════════════════════════════════════╗\n"
+                   "║ [%d] %s\n"
+                   "║ Time  %lg ms, ",
+                   c, child->label,
+                   elapsed_ms( &child->start, &child->end));
+            if ( WIFEXITED( child->status) )
+            {
+                printf( "exit %d", WEXITSTATUS( child->status));
+            } else
+            {
+                printf( "signal %d", WTERMSIG( child->status));
+            }
+            printf( "%s\n", child->timed_out ? ", killed by timeout" : "");
+            print_streams( &mode, streams + c * mode.nstreams);
+            printf("╚═══════════════════════════════════════╝\n");
+
+            for ( int j = 0; j != mode.nstreams; ++j )
+            {
+                const mywc_info_t *info = &streams[c * mode.nstreams + j].info;
+                total[j].child_fd    = mode.child_fds[j];
+                total[j].info.bytes += info->bytes;
+                total[j].info.words += info->words;
+                total[j].info.lines += info->lines;
+
+                const mylat_t *lat = streams[c * mode.nstreams + j].lat;
+                if ( total_lat != NULL && lat != NULL )
+                {
+                    // Time to first output is relative to own command start
+                    mylat_t *sum = &total_lat[j];
+                    total[j].lat = sum;
+                    if ( lat->first_ns != 0 &&
+                         (sum->first_ns == 0 || lat->first_ns - lat->origin_ns < sum->first_ns) )
+                    {
+                        sum->first_ns = lat->first_ns - lat->origin_ns;
+                    }
+                    for ( size_t b = 0; b != LAT_BUCKETS; ++b )
+                    {
+                        sum->gaps[b] += lat->gaps[b];
+                    }
+                    sum->ngaps += lat->ngaps;
+                    if ( lat->max_gap > sum->max_gap )
+                    {
+                        sum->max_gap = lat->max_gap;
+                    }
+                }
+            }
+        }
+        printf("╔═══════════════════════════════════════╗\n"
+               "║ Total: %d commands\n"
+               "║ Time  %lg ms\n",
+               started,
+               elapsed_ms( &start, &end));
+        print_streams( &mode, total);
+        printf("╚═══════════════════════════════════════╝\n");
+        free( total_lat);
+    }
+
+    for ( int i = 0; i != nstreams; ++i )
+    {
+        queue_clear( &streams[i].queue);
+        if ( streams[i].lat != NULL )
+        {
+            free( streams[i].lat->partial);
+            free( streams[i].lat);
+        }
+    }
+    if ( mode.log != NULL )
+    {
+        fclose( mode.log);
+    }
+    free( streams);
+    free( children);
+    free( sh_argv);
+    free( mode.cmds);
+    return status;
+}
+
+// Starts all commands and passes their output until every one is done,
+// returns the number of commands actually started
+int
+run_commands( const mywc_mode_t *mode,
+              mychild_t         *children,
+              int                nchildren,
+              mystream_t        *streams,
+              myoutput_t        *outputs,
+              int                noutputs)
+{
+    int started = 0;
+    for ( ; started != nchildren; ++started )
+    {
+        if ( spawn_child( mode, &children[started], streams + started * mode->nstreams) != EXIT_SUCCESS )
+        {
+            break;
+        }
+    }
+    // Closed stdout is reported by write, not by a signal
+    signal( SIGPIPE, SIG_IGN);
+
+    // Copying pipes of all children and counting info
+    if ( mode->flag_memfd )
+    {
+        copy_memfds( started * mode->nstreams, streams, outputs, noutputs, children, started, mode);
+    } else
+    {
+        copy_files( started * mode->nstreams, streams, outputs, noutputs, children, started, mode);
+    }
+    restore_outputs( outputs, noutputs);
+
+    // Waiting for children not reaped through a pidfd
+    for ( int c = 0; c != started; ++c )
+    {
+        if ( children[c].exited )
+        {
+            continue;
+        }
+        if ( waitpid( children[c].pid, &children[c].status, 0) != children[c].pid ) {
+            perror("waitpid");
+        }
+    }
+    return started;
+}
+
+// Runs the commands once over pipes and once over memfds with output
+// dropped, so only the transport and counting are measured
+int
+run_benchmark( mywc_mode_t *mode,
+               mychild_t   *children,
+               int          nchildren,
+               mystream_t  *streams)
+{
+    static const char *names[2] = { "pipe", "memfd" };
+    double msec[2]  = {};
+    size_t bytes[2] = {};
+    for ( int run = 0; run != 2; ++run )
+    {
+        mode->flag_memfd = ( run == 1 );
+        for ( int c = 0; c != nchildren; ++c )
+        {
+            mychild_t *child = &children[c];
+            *child = (mychild_t){ .label = child->label, .argv = child->argv };
+        }
+        for ( int i = 0; i != nchildren * mode->nstreams; ++i )
+        {
+            streams[i].info     = (mywc_info_t){};
+            streams[i].out      = -1;
+            streams[i].consumed = 0;
+        }
+
+        struct timespec start, end;
+        clock_gettime( CLOCK_MONOTONIC, &start);
+        int started = run_commands( mode, children, nchildren, streams, NULL, 0);
+        clock_gettime( CLOCK_MONOTONIC, &end);
+        if ( started != nchildren )
+        {
+            return EXIT_FAILURE;
+        }
+
+        msec[run] = elapsed_ms( &start, &end);
+        for ( int i = 0; i != nchildren * mode->nstreams; ++i )
+        {
+            bytes[run] += streams[i].info.bytes;
+        }
+    }
+
+    printf("╔═══════════════════════════════════════╗\n"
+           "║ Transport benchmark, %d commands\n", nchildren);
+    for ( int run = 0; run != 2; ++run )
+    {
+        printf("╟───────────────────────────────────────╢\n"
+               "║\t%s:\n"
+               "║\t\t-time:  %lg ms\n"
+               "║\t\t-bytes: %10zu\n"
+               "║\t\t-speed: %lg MiB/s\n",
+               names[run],
+               msec[run],
+               bytes[run],
+               ( msec[run] > 0 ) ? (double)bytes[run] / (1 << 20) / (msec[run] / 1000.) : 0.);
+    }
+    printf("╚═══════════════════════════════════════╝\n");
+    return EXIT_SUCCESS;
+}
+
+int
+spawn_child( const mywc_mode_t *mode,
+             mychild_t         *child,
+             mystream_t        *streams)
+{
+    int pipe_write[MAX_STREAMS];
+    int max_child_fd = 0;
+    for ( int i = 0; i != mode->nstreams; ++i )
+    {
+        int pipefds[2] = { -1, -1 };
+        if ( mode->flag_memfd )
+        {
+            // Both ends are the same file, the child gets its own dup
+            char name[32] = {};
+            snprintf( name, sizeof( name), "wc_err-fd%d", mode->child_fds[i]);
+            pipefds[0] = memfd_create( name, MFD_CLOEXEC);
+            if ( pipefds[0] != -1 )
+            {
+                pipefds[1] = fcntl( pipefds[0], F_DUPFD_CLOEXEC, 0);
+            }
+        }
+        if ( mode->flag_memfd ? (pipefds[1] == -1) : (pipe2( pipefds, O_CLOEXEC) != 0) )
+        {
+            if ( pipefds[0] != -1 )
+            {
+                close( pipefds[0]);
+            }
+            perror( "pipe");
+            for ( int j = 0; j != i; ++j )
+            {
+                close( streams[j].fd_from);
+                close( pipe_write[j]);
+            }
+            return EXIT_FAILURE;
+        }
+        streams[i].fd_from = pipefds[0];
+        pipe_write[i]      = pipefds[1];
+        if ( mode->child_fds[i] > max_child_fd )
+        {
+            max_child_fd = mode->child_fds[i];
+        }
+    }
+
+    child->pidfd = -1;
+    clock_gettime( CLOCK_MONOTONIC, &child->start);
+    for ( int i = 0; i != mode->nstreams; ++i )
+    {
+        if ( streams[i].lat != NULL )
+        {
+            streams[i].lat->origin_ns = (uint64_t)child->start.tv_sec * 1000000000ull +
+                                        child->start.tv_nsec;
+        }
+    }
+    child->pid = fork();
+    if ( child->pid == 0 ) {
+        // Own process group, so the whole tree can be killed on timeout
+        if ( mode->timeout > 0 )
+        {
+            setpgid( 0, 0);
+        }
+        // Moving write ends above every target fd, so that dup2 below
+        // cannot overwrite a pipe that is not placed yet
+        for ( int i = 0; i != mode->nstreams; ++i )
+        {
+            pipe_write[i] = fcntl( pipe_write[i], F_DUPFD_CLOEXEC, max_child_fd + 1);
+        }
+        // Dupping write fds to stdout (1), stderr (2) and extra fds,
+        // everything else is closed on exec
+        for ( int i = 0; i != mode->nstreams; ++i )
+        {
+            dup2( pipe_write[i], mode->child_fds[i] );
+        }
+        // We ignore SIGPIPE, the command gets the default back
+        signal( SIGPIPE, SIG_DFL);
+        // Runtting program in child proccess
+        execvp( child->argv[0], child->argv );
+        // Failure if was here
+        perror( child->argv[0]);
+        _exit( 127);
+    }
+    // Closing write fds for parent
+    for ( int i = 0; i != mode->nstreams; ++i )
+    {
+        close( pipe_write[i] );
+    }
+    if ( child->pid < 0 )
+    {
+        perror( "fork");
+        for ( int i = 0; i != mode->nstreams; ++i )
+        {
+            close( streams[i].fd_from);
+        }
+        return EXIT_FAILURE;
+    }
+    if ( mode->timeout > 0 )
+    {
+        // Same call as in the child, whichever runs first wins
+        setpgid( child->pid, child->pid);
+    }
+    // pidfd is close-on-exec by default
+    child->pidfd = (int)syscall( SYS_pidfd_open, child->pid, 0);
+    child->open_streams = mode->nstreams;
+    return EXIT_SUCCESS;
+}
+
+void
+print_streams( const mywc_mode_t *mode,
+               const mystream_t  *streams)
+{
+    for ( int i = 0; i != mode->nstreams; ++i )
+    {
+        char name[32] = {};
+        printf("╟───────────────────────────────────────╢\n"
+               "║\t%s:\n"
+               "║\t\t-bytes: %10zu\n"
+               "║\t\t-words: %10zu\n"
+               "║\t\t-lines: %10zu\n",
+               stream_name( &streams[i], name, sizeof( name)),
+               streams[i].info.bytes,
+               streams[i].info.words,
+               streams[i].info.lines);
+
+        const mylat_t *lat = streams[i].lat;
+        if ( lat == NULL )
+        {
+            continue;
+        }
+        if ( lat->first_ns == 0 )
+        {
+            printf("║\t\t-first output:   none\n");
+        } else
+        {
+            // Totals keep the time relative to the command start already
+            uint64_t first = lat->first_ns - lat->origin_ns;
+            printf("║\t\t-first output: %lg ms\n", (double)first / 1000000.);
+        }
+        printf("║\t\t-line gap p50: %lg ms\n"
+               "║\t\t-line gap p90: %lg ms\n"
+               "║\t\t-line gap p99: %lg ms\n"
+               "║\t\t-line gap max: %lg ms\n",
+               lat_percentile_ms( lat, 50.),
+               lat_percentile_ms( lat, 90.),
+               lat_percentile_ms( lat, 99.),
+               (double)lat->max_gap / 1000000.);
+    }
+}
+
+int
+get_flags(int          argc,
+          char* const* argv,
+          mywc_mode_t *mode)
+{
+    struct option long_options[] = {
+        {"extra-fd", required_argument, NULL, 'x'},
+        {  "repeat", required_argument, NULL, 'n'},
+        { "command", required_argument, NULL, 'c'},
+        {"timestamps",     no_argument, NULL, 'T'},
+        {     "log", required_argument, NULL, 'l'},
+        { "timeout", required_argument, NULL, 't'},
+        {   "memfd",       no_argument, NULL, 'M'},
+        {   "bench",       no_argument, NULL, 'B'},
+        {0, 0, 0, 0},
+    };
+
+    int opt;
+    int option_index = 0;
+
+    // '+' stops at the first non-option, the rest belongs to the command
+    while ( (opt = getopt_long( argc, argv, "+x:n:c:Tl:t:MB", long_options, &option_index)) != -1 ) {
+        switch ( opt ) {
+            case 'x':
+            {
+                char *end = NULL;
+                long fd = strtol( optarg, &end, 10);
+                if ( *end != '\0' || fd < 3 || fd > 1024 )
+                {
+                    fprintf( stderr, "invalid extra fd: %s (expected 3 and above)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                if ( mode->nstreams == MAX_STREAMS )
+                {
+                    fprintf( stderr, "too many streams\n");
+                    return EXIT_FAILURE;
+                }
+                mode->child_fds[mode->nstreams++] = (int)fd;
+                break;
+            }
+            case 'n':
+            {
+                char *end = NULL;
+                mode->repeat = strtol( optarg, &end, 10);
+                if ( *end != '\0' || mode->repeat < 1 || mode->repeat > 100000 )
+                {
+                    fprintf( stderr, "invalid repeat count: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'c':
+            {
+                const char **cmds = (const char **)realloc( mode->cmds, (mode->ncmds + 1) * sizeof( *cmds));
+                if ( cmds == NULL )
+                {
+                    perror( "realloc");
+                    return EXIT_FAILURE;
+                }
+                mode->cmds = cmds;
+                mode->cmds[mode->ncmds++] = optarg;
+                break;
+            }
+            case 'T': mode->flag_timestamps = true; break;
+            case 'M': mode->flag_memfd      = true; break;
+            case 'B': mode->flag_bench      = true; break;
+            case 't':
+            {
+                char *end = NULL;
+                mode->timeout = strtod( optarg, &end);
+                if ( *end != '\0' || !(mode->timeout > 0) )
+                {
+                    fprintf( stderr, "invalid timeout: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'l':
+            {
+                mode->flag_timestamps = true;
+                mode->log = fopen( optarg, "w");
+                if ( mode->log == NULL )
+                {
+                    perror( optarg);
+                    return EXIT_FAILURE;
+                }
+                setvbuf( mode->log, NULL, _IOFBF, 1 << 16);
+                break;
+            }
+            case '?':
+            default:
+                return EXIT_FAILURE;
+        }
+    }
     return EXIT_SUCCESS;
 }